@@ -0,0 +1,110 @@
+#include "fastjson.h"
+#include <string.h>
+
+
+static int is_space(char c)
+{
+    return (c == ' ') || (c == '\t') || (c == 0x0d) || (c == 0x0a);
+}
+
+// A frame without escapes cannot hide a quoted key inside a string value
+int fastjson_is_plain(const char *span, int len)
+{
+    if (memchr(span, '\\', len) != NULL)
+        return -1;
+    return 0;
+}
+
+// Returns the offset of the first byte of the value belonging to "key", or -1
+static int fastjson_find_value(const char *span, int len, const char *key)
+{
+    int keylen = strlen(key);
+    int pos = 0;
+
+    while (pos + keylen + 2 < len) {
+        const char *q = memchr(span + pos, '"', len - pos);
+        int p;
+
+        if (q == NULL)
+            return -1;
+        p = q - span;
+        pos = p + 1;
+
+        if ((p + keylen + 2 > len) || (span[p + keylen + 1] != '"'))
+            continue;
+        if (memcmp(span + p + 1, key, keylen) != 0)
+            continue;
+
+        p += keylen + 2;
+        while ((p < len) && is_space(span[p]))
+            p++;
+        if ((p >= len) || (span[p] != ':'))
+            continue;   // A string value that happens to match, not a key
+        p++;
+        while ((p < len) && is_space(span[p]))
+            p++;
+        if (p >= len)
+            return -1;
+        return p;
+    }
+    return -1;
+}
+
+int fastjson_get_int(const char *span, int len, const char *key, int *out)
+{
+    int p = fastjson_find_value(span, len, key);
+    int neg = 0;
+    int value = 0;
+    int digits = 0;
+
+    if (p < 0)
+        return -1;
+
+    if (span[p] == '-') {
+        neg = 1;
+        p++;
+    }
+    while ((p < len) && (span[p] >= '0') && (span[p] <= '9') && (digits < 9)) {
+        value = value * 10 + (span[p] - '0');
+        p++;
+        digits++;
+    }
+    if (digits == 0)
+        return -1;
+    // Reject fractions, exponents and anything too long for an int
+    if ((p < len) && (((span[p] >= '0') && (span[p] <= '9')) || (span[p] == '.') || (span[p] == 'e') || (span[p] == 'E')))
+        return -1;
+
+    *out = neg ? -value : value;
+    return 0;
+}
+
+int fastjson_get_string(const char *span, int len, const char *key, const char **out, int *outlen)
+{
+    int p = fastjson_find_value(span, len, key);
+    const char *end;
+
+    if ((p < 0) || (span[p] != '"'))
+        return -1;
+    p++;
+
+    end = memchr(span + p, '"', len - p);
+    if (end == NULL)
+        return -1;
+
+    *out = span + p;
+    *outlen = end - (span + p);
+    return 0;
+}
+
+int fastjson_string_equals(const char *span, int len, const char *key, const char *value)
+{
+    const char *s;
+    int slen;
+
+    if (fastjson_get_string(span, len, key, &s, &slen) < 0)
+        return -1;
+    if ((slen != (int)strlen(value)) || (memcmp(s, value, slen) != 0))
+        return -1;
+    return 0;
+}
@@ -0,0 +1,16 @@
+#ifndef FASTJSON_H
+#define FASTJSON_H
+
+// Allocation free lookups into a single, flat JSON frame. Keys are matched
+// anywhere in the span, so they are only suitable for messages whose key
+// names are unique, e.g. the hub's tracker and feedback events.
+//
+// All functions return 0 on success and -1 when the key is missing or the
+// value is not of the expected type, the caller should then fall back to json-c.
+
+int fastjson_is_plain(const char *span, int len);
+int fastjson_get_int(const char *span, int len, const char *key, int *out);
+int fastjson_get_string(const char *span, int len, const char *key, const char **out, int *outlen);
+int fastjson_string_equals(const char *span, int len, const char *key, const char *value);
+
+#endif
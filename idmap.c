@@ -0,0 +1,91 @@
+#include "idmap.h"
+#include <stdlib.h>
+
+
+// Ids from the hub are small and clustered, spread them over the table
+static unsigned int idmap_hash(unsigned int key)
+{
+    key *= 2654435769u;
+    return key ^ (key >> 16);
+}
+
+int idmap_init(struct idmap_t *m, unsigned int size)
+{
+    unsigned int s = 16;
+
+    while (s < size * 2)
+        s <<= 1;
+
+    m->buckets = malloc(s * sizeof(struct idmap_bucket_t));
+    if (m->buckets == NULL)
+        return -1;
+    m->size = s;
+    idmap_clear(m);
+    return 0;
+}
+
+void idmap_clear(struct idmap_t *m)
+{
+    unsigned int a;
+
+    for (a = 0; a < m->size; a++)
+        m->buckets[a].slot = -1;
+    m->count = 0;
+}
+
+// Returns -1 when the id is not present
+int idmap_get(struct idmap_t *m, unsigned int key)
+{
+    unsigned int i = idmap_hash(key) & (m->size - 1);
+
+    while (m->buckets[i].slot >= 0) {
+        if (m->buckets[i].key == key)
+            return m->buckets[i].slot;
+        i = (i + 1) & (m->size - 1);
+    }
+    return -1;
+}
+
+static int idmap_grow(struct idmap_t *m)
+{
+    struct idmap_bucket_t *old = m->buckets;
+    unsigned int old_size = m->size;
+    unsigned int a;
+
+    m->buckets = malloc(old_size * 2 * sizeof(struct idmap_bucket_t));
+    if (m->buckets == NULL) {
+        m->buckets = old;
+        return -1;
+    }
+    m->size = old_size * 2;
+    idmap_clear(m);
+
+    for (a = 0; a < old_size; a++) {
+        if (old[a].slot >= 0)
+            idmap_put(m, old[a].key, old[a].slot);
+    }
+    free(old);
+    return 0;
+}
+
+// Inserts or replaces, kept at most half full so probes stay short
+int idmap_put(struct idmap_t *m, unsigned int key, int slot)
+{
+    unsigned int i;
+
+    if (((m->count + 1) * 2 > m->size) && (idmap_grow(m) < 0))
+        return -1;
+
+    i = idmap_hash(key) & (m->size - 1);
+    while (m->buckets[i].slot >= 0) {
+        if (m->buckets[i].key == key) {
+            m->buckets[i].slot = slot;
+            return 0;
+        }
+        i = (i + 1) & (m->size - 1);
+    }
+    m->buckets[i].key = key;
+    m->buckets[i].slot = slot;
+    m->count++;
+    return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef IDMAP_H
+#define IDMAP_H
+
+// Open addressed hash from a numeric id to a slot in some flat array. Slots
+// are only ever overwritten or cleared all at once, so there are no
+// tombstones and a miss stops at the first empty bucket.
+struct idmap_bucket_t {
+    unsigned int key;
+    int slot;               // -1 when the bucket is empty
+};
+
+struct idmap_t {
+    struct idmap_bucket_t *buckets;
+    unsigned int size;      // Always a power of two
+    unsigned int count;
+};
+
+int idmap_init(struct idmap_t *m, unsigned int size);
+void idmap_clear(struct idmap_t *m);
+int idmap_get(struct idmap_t *m, unsigned int key);
+int idmap_put(struct idmap_t *m, unsigned int key, int slot);
+
+#endif
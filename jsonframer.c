@@ -0,0 +1,130 @@
+#include "jsonframer.h"
+#include "log.h"
+#include <stdio.h>
+#include <string.h>
+
+// json_tokener_get_parse_end() arrived in json-c 0.15, older releases only
+// have the public char_offset field it returns
+#if defined(JSON_C_VERSION_NUM) && (JSON_C_VERSION_NUM >= ((0 << 16) | (15 << 8)))
+#define json_framer_parse_end(tok) json_tokener_get_parse_end(tok)
+#else
+#define json_framer_parse_end(tok) ((size_t)(tok)->char_offset)
+#endif
+
+int json_framer_init(struct json_framer_t *f, void *pvt, int (*func_object)(void *, json_object *))
+{
+    memset(f, 0, sizeof(struct json_framer_t));
+    f->pvt = pvt;
+    f->func_object = func_object;
+    f->tok = json_tokener_new();
+    if (f->tok == NULL)
+        return -1;
+    return 0;
+}
+
+// Forget any partial object, e.g. after the connection dropped
+void json_framer_reset(struct json_framer_t *f)
+{
+    json_tokener_reset(f->tok);
+    f->in_object = 0;
+    f->frame_len = 0;
+    f->resync = 0;
+}
+
+void json_framer_free(struct json_framer_t *f)
+{
+    if (f->tok != NULL)
+        json_tokener_free(f->tok);
+    f->tok = NULL;
+}
+
+static int is_separator(char c)
+{
+    return (c == 0x0d) || (c == 0x0a) || (c == ' ') || (c == '\t') || (c == 0);
+}
+
+// Offset of the line break terminating the frame starting at pos, -1 when
+// the frame continues in the next chunk. JSON strings cannot hold raw line breaks.
+static int frame_end(const char *buffer, int pos, int len)
+{
+    int a;
+
+    for (a = pos; a < len; a++) {
+        if ((buffer[a] == 0x0d) || (buffer[a] == 0x0a))
+            return a;
+    }
+    return -1;
+}
+
+void json_framer_feed(struct json_framer_t *f, const char *buffer, int len)
+{
+    int pos = 0;
+
+    while (pos < len) {
+        json_object *obj;
+        enum json_tokener_error jerr;
+
+        if (f->resync) {
+            int end = frame_end(buffer, pos, len);
+
+            if (end < 0)
+                return;
+            pos = end + 1;
+            f->resync = 0;
+            continue;
+        }
+
+        if (f->in_object == 0) {
+            while ((pos < len) && is_separator(buffer[pos]))
+                pos++;
+            if (pos == len)
+                return;
+            if (buffer[pos] != '{') {
+                f->resync = 1;
+                continue;
+            }
+            if (f->func_span != NULL) {
+                int end = frame_end(buffer, pos, len);
+
+                if ((end > pos) && (f->func_span(f->pvt, buffer + pos, end - pos) == 0)) {
+                    pos = end;
+                    continue;
+                }
+            }
+            f->in_object = 1;
+            f->frame_len = 0;
+        }
+
+        obj = json_tokener_parse_ex(f->tok, buffer + pos, len - pos);
+        jerr = json_tokener_get_error(f->tok);
+
+        if (jerr == json_tokener_continue) {
+            f->frame_len += len - pos;
+            if (f->frame_len > JSON_FRAMER_MAX_FRAME) {
+                log_printf(LOG_WARNING,"Dropping JSON frame larger than %d bytes\r\n",JSON_FRAMER_MAX_FRAME);
+                json_framer_reset(f);
+                f->resync = 1;
+            }
+            return;
+        }
+
+        if (jerr != json_tokener_success) {
+            log_printf(LOG_WARNING,"JSON frame error: %s\r\n",json_tokener_error_desc(jerr));
+            json_framer_reset(f);
+            f->resync = 1;
+            continue;
+        }
+
+        // The tokener stops right after the closing brace, the rest is the next frame
+        pos += json_framer_parse_end(f->tok);
+        json_tokener_reset(f->tok);
+        f->in_object = 0;
+        f->frame_len = 0;
+
+        if (obj != NULL) {
+            if (f->func_object != NULL)
+                f->func_object(f->pvt, obj);
+            json_object_put(obj);
+        }
+    }
+}
@@ -0,0 +1,29 @@
+#ifndef JSONFRAMER_H
+#define JSONFRAMER_H
+
+#include <json-c/json.h>
+
+// Largest single object we are prepared to buffer inside the tokener
+#define JSON_FRAMER_MAX_FRAME (256*1024)
+
+// Splits a byte stream of CR/LF separated JSON objects into parsed objects.
+// Chunks can be fed as they arrive, objects are handed to func_object as
+// soon as their closing brace has been seen.
+struct json_framer_t {
+    json_tokener *tok;
+    int in_object;      // The tokener holds a partial object
+    int frame_len;      // Bytes fed into the current object
+    int resync;         // Dropping bytes up to the next line break
+    void *pvt;
+    int (*func_object)(void *pvt, json_object *obj);
+    // Optional fast path, offered every frame that is complete within one
+    // chunk. Returning 0 consumes the frame, anything else hands it to json-c.
+    int (*func_span)(void *pvt, const char *span, int len);
+};
+
+int json_framer_init(struct json_framer_t *f, void *pvt, int (*func_object)(void *, json_object *));
+void json_framer_reset(struct json_framer_t *f);
+void json_framer_free(struct json_framer_t *f);
+void json_framer_feed(struct json_framer_t *f, const char *buffer, int len);
+
+#endif
@@ -0,0 +1,244 @@
+#include "log.h"
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+
+// Bounded multi-producer ring, each slot carries a sequence number that says
+// whether it is free for the producer at pos (seq == pos) or filled for the
+// consumer (seq == pos + 1)
+struct log_slot_t {
+    unsigned long seq;
+    int priority;
+    char text[LOG_MESSAGE_SIZE];
+};
+
+int log_level = LOG_NOTICE;
+
+static struct log_slot_t log_ring[LOG_RING_SLOTS];
+static unsigned long log_enqueue_pos;
+static unsigned long log_dequeue_pos;
+static unsigned long log_dropped;
+static sem_t log_ready;
+static int log_started;
+static struct log_site_t *log_sites;
+
+static const char *log_names[] = { "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug" };
+
+
+void log_set_level(int level)
+{
+    if (level < LOG_EMERG)
+        level = LOG_EMERG;
+    if (level > LOG_DEBUG)
+        level = LOG_DEBUG;
+    __atomic_store_n(&log_level,level,__ATOMIC_RELAXED);
+}
+
+// Accepts a syslog level name or its number, returns -1 for anything else
+int log_parse_level(const char *name)
+{
+    int a;
+
+    for (a = LOG_EMERG; a <= LOG_DEBUG; a++) {
+        if (strcasecmp(name,log_names[a]) == 0)
+            return a;
+    }
+    if ((name[0] >= '0') && (name[0] <= '7') && (name[1] == 0))
+        return name[0] - '0';
+    return -1;
+}
+
+// SIGUSR1 logs more, SIGUSR2 logs less
+static void log_signal(int sig)
+{
+    int level = __atomic_load_n(&log_level,__ATOMIC_RELAXED);
+
+    log_set_level(sig == SIGUSR1 ? level + 1 : level - 1);
+}
+
+static struct log_slot_t *log_claim(void)
+{
+    unsigned long pos = __atomic_load_n(&log_enqueue_pos,__ATOMIC_RELAXED);
+
+    while (1) {
+        struct log_slot_t *slot = &log_ring[pos & (LOG_RING_SLOTS - 1)];
+        long diff = (long)(__atomic_load_n(&slot->seq,__ATOMIC_ACQUIRE) - pos);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&log_enqueue_pos,&pos,pos + 1,1,__ATOMIC_RELAXED,__ATOMIC_RELAXED))
+                return slot;
+        } else if (diff < 0) {
+            __atomic_add_fetch(&log_dropped,1,__ATOMIC_RELAXED);
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&log_enqueue_pos,__ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void log_commit(struct log_slot_t *slot, unsigned long pos)
+{
+    __atomic_store_n(&slot->seq,pos + 1,__ATOMIC_RELEASE);
+    sem_post(&log_ready);
+}
+
+// Before log_init() there is no writer, go straight to syslog
+static void log_text(int priority, const char *fmt, va_list ap)
+{
+    struct log_slot_t *slot;
+    unsigned long pos;
+
+    if (__atomic_load_n(&log_started,__ATOMIC_ACQUIRE) == 0) {
+        vsyslog(priority,fmt,ap);
+        return;
+    }
+
+    slot = log_claim();
+    if (slot == NULL)
+        return;
+    pos = __atomic_load_n(&slot->seq,__ATOMIC_RELAXED);
+    slot->priority = priority;
+    vsnprintf(slot->text,sizeof(slot->text),fmt,ap);
+    log_commit(slot,pos);
+}
+
+static unsigned long long log_second(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE,&ts);
+    return ts.tv_sec;
+}
+
+// site is NULL for log_dump, which is never rate limited
+void log_write(struct log_site_t *site, int priority, const char *fmt, ...)
+{
+    unsigned long long second;
+    va_list ap;
+
+    if (site == NULL)
+        goto write;
+
+    second = log_second();
+    if (__atomic_load_n(&site->second,__ATOMIC_RELAXED) != second) {
+        if (__atomic_exchange_n(&site->second,second,__ATOMIC_RELAXED) != second)
+            __atomic_store_n(&site->count,0,__ATOMIC_RELAXED);
+    }
+
+    if (__atomic_add_fetch(&site->count,1,__ATOMIC_RELAXED) > LOG_RATE_BURST) {
+        // First time over the limit, put the site where the writer can report it
+        if (__atomic_exchange_n(&site->registered,1,__ATOMIC_RELAXED) == 0) {
+            site->priority = priority;
+            site->next = __atomic_load_n(&log_sites,__ATOMIC_RELAXED);
+            while (!__atomic_compare_exchange_n(&log_sites,&site->next,site,1,__ATOMIC_RELEASE,__ATOMIC_RELAXED))
+                ;
+        }
+        __atomic_add_fetch(&site->suppressed,1,__ATOMIC_RELAXED);
+        return;
+    }
+
+write:
+    va_start(ap,fmt);
+    log_text(priority,fmt,ap);
+    va_end(ap);
+}
+
+// Reports what each rate-limited site held back during the seconds that are over
+static void log_report_suppressed(void)
+{
+    unsigned long long second = log_second();
+    struct log_site_t *site;
+
+    for (site = __atomic_load_n(&log_sites,__ATOMIC_ACQUIRE); site != NULL; site = site->next) {
+        unsigned int suppressed;
+
+        if (__atomic_load_n(&site->second,__ATOMIC_RELAXED) == second)
+            continue;
+        suppressed = __atomic_exchange_n(&site->suppressed,0,__ATOMIC_RELAXED);
+        if (suppressed > 0)
+            syslog(site->priority,"%u messages suppressed from %s:%d",suppressed,site->file,site->line);
+    }
+}
+
+// One sem_post per committed message, so the writer sleeps only when the ring
+// is empty, and wakes at least once a second to report suppressed messages
+static void *log_thread(void *paramPtr)
+{
+    unsigned long long reported = 0;
+
+    while (1) {
+        struct log_slot_t *slot = &log_ring[log_dequeue_pos & (LOG_RING_SLOTS - 1)];
+        unsigned long dropped;
+        struct timespec ts;
+        int rc;
+
+        clock_gettime(CLOCK_REALTIME,&ts);
+        ts.tv_sec++;
+        rc = sem_timedwait(&log_ready,&ts);
+
+        if (log_second() != reported) {
+            reported = log_second();
+            log_report_suppressed();
+        }
+        if (rc < 0)
+            continue;
+
+        // A later slot may have been committed first, this one is still being formatted
+        while (__atomic_load_n(&slot->seq,__ATOMIC_ACQUIRE) != log_dequeue_pos + 1)
+            sched_yield();
+
+        syslog(slot->priority,"%s",slot->text);
+        __atomic_store_n(&slot->seq,log_dequeue_pos + LOG_RING_SLOTS,__ATOMIC_RELEASE);
+        __atomic_store_n(&log_dequeue_pos,log_dequeue_pos + 1,__ATOMIC_RELEASE);
+
+        dropped = __atomic_exchange_n(&log_dropped,0,__ATOMIC_RELAXED);
+        if (dropped > 0)
+            syslog(LOG_WARNING,"Log ring full, %lu messages dropped\r\n",dropped);
+    }
+    return NULL;
+}
+
+void log_init(const char *ident, int level)
+{
+    pthread_t thread;
+    unsigned long a;
+
+    openlog(ident,LOG_CONS | LOG_PID | LOG_NDELAY,LOG_LOCAL1);
+    log_set_level(level);
+
+    for (a = 0; a < LOG_RING_SLOTS; a++)
+        log_ring[a].seq = a;
+    sem_init(&log_ready,0,0);
+
+    signal(SIGUSR1,log_signal);
+    signal(SIGUSR2,log_signal);
+
+    if (pthread_create(&thread,NULL,log_thread,NULL) == 0) {
+        pthread_detach(thread);
+        __atomic_store_n(&log_started,1,__ATOMIC_RELEASE);
+    }
+}
+
+// Gives the writer up to a second to empty the ring, for use before exit()
+void log_flush(void)
+{
+    int a;
+
+    if (__atomic_load_n(&log_started,__ATOMIC_ACQUIRE) == 0)
+        return;
+
+    for (a = 0; a < 1000; a++) {
+        if (__atomic_load_n(&log_dequeue_pos,__ATOMIC_ACQUIRE) == __atomic_load_n(&log_enqueue_pos,__ATOMIC_RELAXED))
+            return;
+        usleep(1000);
+    }
+}
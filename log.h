@@ -0,0 +1,48 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <syslog.h>
+
+// Callers format into a slot of a lock-free ring and return, a writer thread
+// hands the slots to syslog. A full ring drops the message rather than wait.
+// Every log_printf call site passes LOG_RATE_BURST messages per second, the
+// rest are counted and the writer reports the total against the site's file
+// and line once that second is over. log_dump is for one-shot listings that
+// run in a loop, it is never rate limited.
+
+#define LOG_RING_SLOTS      1024        // Power of two
+#define LOG_MESSAGE_SIZE    256
+#define LOG_RATE_BURST      20
+
+struct log_site_t {
+    unsigned long long second;
+    unsigned int count;
+    unsigned int suppressed;
+    int priority;
+    const char *file;
+    int line;
+    int registered;             // On the writer's list once it has suppressed anything
+    struct log_site_t *next;
+};
+
+extern int log_level;
+
+void log_init(const char *ident, int level);
+void log_set_level(int level);
+int log_parse_level(const char *name);
+void log_flush(void);
+void log_write(struct log_site_t *site, int priority, const char *fmt, ...) __attribute__((format(printf,3,4)));
+
+// Messages above the current level cost one compare
+#define log_printf(priority, ...) do { \
+    static struct log_site_t log_site_ = { .file = __FILE__, .line = __LINE__ }; \
+    if ((priority) <= __atomic_load_n(&log_level,__ATOMIC_RELAXED)) \
+        log_write(&log_site_,(priority),__VA_ARGS__); \
+} while (0)
+
+#define log_dump(priority, ...) do { \
+    if ((priority) <= __atomic_load_n(&log_level,__ATOMIC_RELAXED)) \
+        log_write(NULL,(priority),__VA_ARGS__); \
+} while (0)
+
+#endif
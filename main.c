@@ -24,30 +24,87 @@ OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
        
 
   Usage
-  rako_adapter -r <RAKO ip address> -m <MQTT IP> -u <MQTT Username> -p <MQTT Password
+  rako_adapter -r <RAKO ip address[:port]> -m <MQTT IP> -u <MQTT Username> -p <MQTT Password
+               [-w <MQTT coalesce window ms>] [-c <command coalesce window ms>]
 */
  
 
 #include <stdio.h>
+#include <ctype.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <getopt.h>
-#include <syslog.h>
+#include <pthread.h>
+#include <errno.h>
 
 #include <json-c/json.h>
 #include "socketclient.h"
+#include "jsonframer.h"
+#include "fastjson.h"
+#include "topicmap.h"
+#include "idmap.h"
+#include "metrics.h"
+#include "log.h"
 #include "mqtt.h"
 
-#define MAX_ROOMS 32
-#define MAX_CHANNELS 16
+#define RAKO_TOPICS_PER_HUB 512         // Initial command map size, it grows past this
+
+// channel_slots key, room ids fit comfortably in 16 bits on a real hub
+#define RAKO_CHANNEL_KEY(room,channel) (((unsigned int)(room) << 16) | ((unsigned int)(channel) & 0xffff))
+
+// Socket timer ids
+#define RAKO_TIMER_KEEPALIVE 1
+#define RAKO_TIMER_WATCHDOG  2
+#define RAKO_TIMER_REFRESH   3
+#define RAKO_TIMER_COMMANDS  4
+#define RAKO_TIMER_REDISCOVER 5
+#define RAKO_TIMER_FADE      6
+#define RAKO_TIMER_QUERIES   7
+
+#define RAKO_KEEPALIVE_MS      10000
+#define RAKO_WATCHDOG_MS       5000
+#define RAKO_REFRESH_MS        300000
+#define RAKO_REDISCOVER_MS     3600000 // Resumed sessions still pick up reprogramming
+#define RAKO_FADE_GRACE_MS     250     // Fades ending this close together share one check
+#define RAKO_FADE_ROOM_QUERIES 4       // More rooms than this to check and the whole house is read
+
+#define RAKO_COMMAND_QUEUE     256     // Must be a power of two
+#define RAKO_COMMAND_WINDOW_MS 50      // Default slider coalescing window
+
+// Pacing of frames to the hub, commands and queries share the bucket
+#define RAKO_TX_RATE           20      // Default frames per second once the burst is spent, -s
+#define RAKO_TX_BURST          10      // Default frames back to back, -b
+#define RAKO_QUERY_QUEUE       16      // Must be a power of two
+#define RAKO_QUERY_TIMEOUT_MS  5000    // No answer by then and the next query goes anyway
+
+#define RAKO_QUERY_ROOM        0
+#define RAKO_QUERY_CHANNEL     1
+#define RAKO_QUERY_LEVEL       2
+#define RAKO_QUERY_STATUS      3       // Never queued, written straight away, only awaited
+
+#define RAKO_MAX_HUBS          8
+#define RAKO_SCENES            6       // Scene switches published per room, 0 is off
+#define RAKO_SCENE_LEVELS      17      // sceneLevels entries per channel, indexed by scene
+#define RAKO_FEEDBACK_SCENE    49      // Feedback command of a scene change, the others are fades, stops and levels
+
+#define RAKO_CACHE_MAGIC       "RKC1"
+#define RAKO_CACHE_VERSION     2
 
 
 // --------------- Forward prototypes -----------------------//
-void setup_socket(struct socket_client_t *rako_sock, void *pvt);
-int rako_idle_callback(void *pvt,struct socket_client_t* sp);
+void setup_socket(struct socket_loop_t *loop, struct socket_client_t *rako_sock, void *pvt);
+int rako_keepalive_timer(void *pvt,struct socket_client_t* sp);
+int rako_watchdog_timer(void *pvt,struct socket_client_t* sp);
+int rako_refresh_timer(void *pvt,struct socket_client_t* sp);
+int rako_rediscover_timer(void *pvt,struct socket_client_t* sp);
+int rako_command_timer(void *pvt,struct socket_client_t* sp);
+int rako_fade_timer(void *pvt,struct socket_client_t* sp);
+int rako_query_timer(void *pvt,struct socket_client_t* sp);
 int rako_connect_callback(void *pvt, struct socket_client_t* sp, int fd);
 int rako_parse_callback(void *pvt,struct socket_client_t* sp, int fd, char* buffer, int len);
+int rako_object_callback(void *pvt, json_object *obj);
+int rako_span_callback(void *pvt, const char *span, int len);
 int mqtt_homeassistant_callback(char *node,char *msg, int len, void *p);
 unsigned int tokenize(char **result, unsigned int reslen, char *str, char delim);
 void send_level(struct socket_client_t* sp, int roomid, int channel, int level);
@@ -56,30 +113,138 @@ int parse_status(void *pvt, struct socket_client_t *sp);
 void send_room_request(struct socket_client_t* sp);
 void send_channel_request(struct socket_client_t* sp);
 void send_level_request(struct socket_client_t* sp);
+void send_room_level_request(struct socket_client_t* sp, int roomid);
+int parse_query_room(void *pvt, struct socket_client_t *sp);
+int parse_query_channel(void *pvt, struct socket_client_t *sp);
+int parse_query_levels(void *pvt, struct socket_client_t *sp);
+int parse_tracker(void *pvt, struct socket_client_t *sp);
+int parse_feedback(void *pvt, struct socket_client_t *sp);
+struct rako_data_t;
+void publish_discovery(struct rako_data_t *param,int roomid,int channel_id,char *name, char *unique_name);
+void publish_scene(struct rako_data_t *param,int roomid,int channel_id,char *name, char *unique_name);
+void publish_room(struct rako_data_t *param,int roomid,char *name);
+void update_scene(struct rako_data_t *param,int roomid,int channel_id,int scene);
+void publish_state(struct rako_data_t *param,int roomid,int channel_id,int level,int transition_ms);
+void rako_mqtt_connected(void *p);
 //----------------------------------------------------------//
 
 struct channels_t {
-    char enabled;
+    int  channel_id;
+    char dirty;                     // Queued on rako_data_t.dirty_channels
     char channel_name[32];
     char channel_type[32];
+    int  current_level;             // -1 until the hub reports it
+    int  target_level;              // What HA is shown
+    unsigned long long last_published;
+    unsigned char scene_levels[RAKO_SCENE_LEVELS];
+    char has_scene_levels;
+    char predicted;                 // target_level came from scene_levels, no tracker seen yet
+    int  fade_from;                 // currentLevel when the running fade was reported
+    unsigned long long fade_due;    // When it reaches target_level, 0 when not fading
 };
 
 struct rooms_t {
-    int  enabled;
-    int  current_scene;
+    int  room_id;
+    int  current_scene;             // -1 until the hub reports it
+    char scene_dirty;
+    char fade_check;                // A fade here ended, its levels are read back
+    int  fan_in;                    // Scratch for rako_fan_in, channels the queue covers
+    unsigned long long scene_published;
     char room_name[64];
     char device_type[32];
-    struct channels_t channels[MAX_CHANNELS];
+    struct channels_t *channels;    // Sorted by channel_id, only those the hub reported
+    int  channel_count;
+    int  channel_alloc;
 };
 
 
+// Decoded event bodies, filled either by json-c or by the fast path
+struct rako_tracker_t {
+    int room;
+    int channel;
+    int current_level;
+    int target_level;
+    int time_to_take;
+};
+
+struct rako_feedback_t {
+    int room;
+    int channel;
+    int scene;
+    int command;
+};
+
+// Where a homeassistant/light/rako_.../set topic goes, built during discovery
+struct rako_command_t {
+    struct rako_data_t *hub;
+    int room;
+    int channel;
+    int scene;              // Channel 0 scene switches, -1 for the whole room at one level
+    char state_topic[128];
+};
+
+// What was last published on one discovery config topic
+struct rako_discovery_t {
+    unsigned int hash;
+    unsigned int generation;    // Discovery pass that last produced this config
+    char *payload;              // NULL when only the hash came from the cache
+};
+
+// Discovery cache file, a header then rooms each followed by their
+// channels, then the config hashes, then a checksum of all of it
+struct rako_cache_header_t {
+    char magic[4];
+    unsigned int version;
+    unsigned int room_count;
+    unsigned int config_count;
+    char product_type[32];
+    char hub_id[48];
+    char hub_mac[20];
+    char hub_version[16];
+    char topic_prefix[64];
+};
+
+struct rako_cache_room_t {
+    int room_id;
+    int channel_count;
+    char room_name[64];
+    char device_type[32];
+};
+
+struct rako_cache_channel_t {
+    int channel_id;
+    char channel_name[32];
+    char channel_type[32];
+    unsigned char scene_levels[RAKO_SCENE_LEVELS];
+    char has_scene_levels;
+};
+
+struct rako_cache_config_t {
+    unsigned int hash;
+    unsigned int topic_len;     // Topic bytes follow, not terminated
+};
+
+// A query waiting for its turn on the hub link
+struct rako_query_t {
+    int type;               // RAKO_QUERY_*
+    int room;               // LEVEL only, 0 for the whole house
+    int pipelined;          // Goes without waiting for earlier answers, discovery only
+};
+
+// A command from HA waiting to go to the hub
+struct rako_cmd_t {
+    int room;               // -1 once folded into a room or house command ahead of it
+    int channel;            // 0 for every channel of the room, room 0 is the house
+    int scene;              // -1 for a level command
+    int level;
+    unsigned long long due;
+};
+
 struct rako_data_t {
-    char state;
-    int counter;
-    int last_send;
-    int keepalive_counter;
-    char buffer[32768*4];
-    int buffer_ptr;
+    unsigned int awaiting;          // 1 << RAKO_QUERY_* for each answer discovery still needs
+    unsigned long long discovery_started;   // metrics_now_us() when it was asked
+    int ready;                      // Discovery completed once, counted in rako_ready_count
+    struct json_framer_t framer;
     json_object *rx_json;
 
     char rako_address[64];
@@ -87,34 +252,160 @@ struct rako_data_t {
     char hub_id[48];
     char hub_mac[20];
     char hub_version[16];
-
-    struct rooms_t rooms[MAX_ROOMS];
+    char topic_prefix[64];          // rako, or rako_<hubId> with several hubs, empty until known
+
+    // Rooms the hub reported, sorted by room_id. Slots move when a room or
+    // channel is inserted, so anything kept across calls holds ids instead
+    struct rooms_t *rooms;
+    int room_count;
+    int room_alloc;
+    int channel_total;
+    struct idmap_t room_slots;      // roomId -> index in rooms
+    struct idmap_t channel_slots;   // RAKO_CHANNEL_KEY -> index in rooms[].channels
     void *socket_pvt;
 
+    // Mirror entries changed since the last rako_publish_dirty()
+    unsigned int *dirty_channels;   // RAKO_CHANNEL_KEY, sized to channel_total
+    int dirty_channel_count;
+    int *dirty_rooms;               // roomId, sized to room_alloc
+    int dirty_room_count;
+    int discovered;                 // A CHANNEL answer was handled, reconnects only read levels
+    int publish_pending;            // Discovered before the prefix was known, rako_set_prefix publishes it
+    int republish;                  // Set by the MQTT thread after a broker reconnect
+    int rediscover;                 // Same, but the broker may also have lost the configs
+
+    // Discovery configs as last published, config topic -> struct rako_discovery_t
+    struct topicmap_t discovery;
+    int config_force;               // Publish even when the hash matches
+    unsigned int discovery_generation;
+    char cache_path[256];           // Empty unless -C was given
+    unsigned int cache_checksum;    // Of the file last written, identical saves are skipped
+
+    // HA commands, queued on the MQTT thread and sent by rako_command_timer
+    struct rako_cmd_t commands[RAKO_COMMAND_QUEUE];
+    unsigned int cmd_head;
+    unsigned int cmd_tail;
+    unsigned int cmd_depth;         // Last added to METRIC_COMMAND_QUEUE_DEPTH
+    int command_window;
+    pthread_mutex_t cmd_lock;
+
+    // Queries, socket thread only. They wait while any command is queued
+    // and go one at a time, so a large answer never sits ahead of a switch
+    struct rako_query_t queries[RAKO_QUERY_QUEUE];
+    unsigned int query_head;
+    unsigned int query_tail;
+    int query_answers;              // Still to come for the queries sent
+    unsigned long long query_sent;
+
+    // Token bucket for every frame to the hub, in thousandths of a frame
+    int tx_rate;                    // Frames per second, 0 sends unpaced
+    int tx_burst;
+    int tx_tokens;
+    unsigned long long tx_refilled;
+
+    // Fades reported by tracker events, one timer for the earliest end
+    unsigned long long fade_due;    // What RAKO_TIMER_FADE is set for, 0 when idle
+    int transitions;                // Publish the remaining fade time as HA transition
+};
+
+int handle_tracker(struct rako_data_t *param, struct rako_tracker_t *event);
+void rako_track_fade(struct rako_data_t *param, struct rako_tracker_t *event);
+void rako_reset_fades(struct rako_data_t *param);
+int handle_feedback(struct rako_data_t *param, struct rako_feedback_t *event);
+int rako_decode_command(char *msg, int len, int *on, int *level);
+void rako_reset_rooms(struct rako_data_t *param);
+struct rooms_t *rako_find_room(struct rako_data_t *param, int room);
+struct channels_t *rako_find_channel(struct rako_data_t *param, int room, int channel);
+struct rooms_t *rako_add_room(struct rako_data_t *param, int room);
+struct channels_t *rako_add_channel(struct rako_data_t *param, struct rooms_t *rm, int channel);
+void rako_set_level(struct rako_data_t *param, int room, int channel, int current, int target);
+void rako_set_scene(struct rako_data_t *param, int room, int scene);
+void rako_predict_scene(struct rako_data_t *param, int room, int scene);
+void rako_publish_dirty(struct rako_data_t *param);
+int rako_queue_command(struct rako_data_t *param, int room, int channel, int scene, int level);
+int rako_queue_query(struct rako_data_t *param, int type, int room, int pipelined);
+void rako_query_pump(struct rako_data_t *param);
+void rako_query_answered(struct rako_data_t *param, int type);
+void rako_start_discovery(struct rako_data_t *param, int full);
+void rako_reset_link(struct rako_data_t *param);
+void rako_register_command(struct rako_data_t *param, const char *base, int roomid, int channel_id, int scene);
+void rako_set_prefix(struct rako_data_t *param);
+int rako_publish_config(struct rako_data_t *param, char *topic, char *payload);
+void rako_publish_model(struct rako_data_t *param);
+void rako_discovery_sweep(struct rako_data_t *param);
+int rako_cache_load(struct rako_data_t *param);
+void rako_cache_save(struct rako_data_t *param);
+
+// Command topic -> struct rako_command_t, only touched on the socket thread
+static struct topicmap_t rako_commands;
+
+// Every hub given with -r, fixed before the MQTT and socket threads start
+static struct rako_data_t *rako_hubs[RAKO_MAX_HUBS];
+static int rako_hub_count;
+
+// Hubs whose discovery has completed, main waits on it
+static pthread_mutex_t rako_ready_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rako_ready_cond = PTHREAD_COND_INITIALIZER;
+static int rako_ready_count;
+
+// What other threads may see of the model. A snapshot is never changed
+// once published: the socket thread builds a new one after discovery and
+// swaps the pointer. Readers only count themselves in and out, and a
+// replaced snapshot is freed once no reader is inside.
+struct rako_snapshot_hub_t {
+    struct rako_data_t *hub;
+    struct rooms_t *rooms;          // Copies, only the identity fields mean anything
+    int room_count;
+};
+
+struct rako_snapshot_t {
+    struct topicmap_t commands;     // Command topic -> struct rako_command_t, copies
+    struct rako_snapshot_hub_t hubs[RAKO_MAX_HUBS];
+    struct rako_snapshot_t *retired_next;
 };
 
+static struct rako_snapshot_t *rako_view;
+static int rako_view_readers;
+static struct rako_snapshot_t *rako_view_retired;   // Socket thread only
 
+struct rako_snapshot_t *rako_view_enter(void);
+void rako_view_leave(void);
+void rako_view_publish(void);
+void rako_view_reclaim(void);
+struct rako_snapshot_hub_t *rako_view_hub(struct rako_snapshot_t *view, struct rako_data_t *param);
+
+
+// Reads the published snapshot, so it is safe from any thread
 void dump_settings(struct rako_data_t *rako_data)
 {
-
-   syslog(LOG_NOTICE,"Product_Type:\t\t%s\r\n",rako_data->product_type);
-   syslog(LOG_NOTICE,"Product_HubId:\t\t%s\r\n",rako_data->hub_id);
-   syslog(LOG_NOTICE,"Product_MAC:\t\t%s\r\n",rako_data->hub_mac);
-   syslog(LOG_NOTICE,"Product_Version:\t%s\r\n",rako_data->hub_version);
+    struct rako_snapshot_t *view;
+    struct rako_snapshot_hub_t *model;
+
+   log_dump(LOG_NOTICE,"Hub:\t\t\t%s [%s]\r\n",rako_data->rako_address,rako_data->topic_prefix);
+   log_dump(LOG_NOTICE,"Product_Type:\t\t%s\r\n",rako_data->product_type);
+   log_dump(LOG_NOTICE,"Product_HubId:\t\t%s\r\n",rako_data->hub_id);
+   log_dump(LOG_NOTICE,"Product_MAC:\t\t%s\r\n",rako_data->hub_mac);
+   log_dump(LOG_NOTICE,"Product_Version:\t%s\r\n",rako_data->hub_version);
+
+    view = rako_view_enter();
+    model = rako_view_hub(view,rako_data);
+    if (model == NULL) {
+        rako_view_leave();
+        return;
+    }
 
     int a;
-    for (a=0; a<MAX_ROOMS; a++) {
-        if (rako_data->rooms[a].enabled == 1) {
-           syslog(LOG_NOTICE,"Room %d [%s] %s\r\n",a,rako_data->rooms[a].device_type,rako_data->rooms[a].room_name);
-            int b;
-            for (b=0; b<MAX_CHANNELS; b++) {
-                if (rako_data->rooms[a].channels[b].enabled == 1) {
-                   syslog(LOG_NOTICE,"\tChannel %d\t%s\r\n",b,rako_data->rooms[a].channels[b].channel_name);
-                }
-            }
-           syslog(LOG_NOTICE,"\r\n");
+    for (a=0; a<model->room_count; a++) {
+        struct rooms_t *rm = &model->rooms[a];
+
+       log_dump(LOG_NOTICE,"Room %d [%s] %s\r\n",rm->room_id,rm->device_type,rm->room_name);
+        int b;
+        for (b=0; b<rm->channel_count; b++) {
+           log_dump(LOG_NOTICE,"\tChannel %d\t%s\r\n",rm->channels[b].channel_id,rm->channels[b].channel_name);
         }
+       log_dump(LOG_NOTICE,"\r\n");
     }
+    rako_view_leave();
     return;
 }
 
@@ -131,8 +422,12 @@ int isThisAHub(struct rako_data_t *rako_data)
 
 void print_usage(void)
 {
-   syslog(LOG_NOTICE,"Usage\r\n");
-   syslog(LOG_NOTICE,"rako_adapter -r <RAKO ip address> -m <MQTT IP> -u <MQTT Username> -p <MQTT Password\r\n");
+   log_printf(LOG_NOTICE,"Usage\r\n");
+   log_printf(LOG_NOTICE,"rako_adapter -r <RAKO ip address[:port]> [-r <another hub> ...] -m <MQTT IP> -u <MQTT Username> -p <MQTT Password\r\n");
+   log_printf(LOG_NOTICE,"             [-w <MQTT coalesce window ms>] [-c <command coalesce window ms>] [-M <metrics [address:]port>]\r\n");
+   log_printf(LOG_NOTICE,"             [-s <hub frames/sec, 0 unpaced>] [-b <hub frames back to back>]\r\n");
+   log_printf(LOG_NOTICE,"             [-l <log level err|warning|notice|info|debug>] (SIGUSR1/SIGUSR2 raise/lower it)\r\n");
+   log_printf(LOG_NOTICE,"             [-C <directory for the discovery cache>] [-t publish fade transitions]\r\n");
 
     return;
 }
@@ -142,17 +437,28 @@ void print_usage(void)
 
 int main(int argc, char **argv)
 {
-    struct socket_client_t rako_client;
-    struct rako_data_t rako_data;
+    struct socket_loop_t *rako_loop;
 
     char mqtt_user[64] = {0};
     char mqtt_password[64] = {0};
     char mqtt_address[64] = {0};
-    char rako_address[64];
+    char rako_address[RAKO_MAX_HUBS][64];
+    char cache_dir[192] = {0};
+    int hub_count = 0;
+    int a;
 
+    int coalesce_ms = MQTT_COALESCE_MS;
+    int command_ms = RAKO_COMMAND_WINDOW_MS;
+    int tx_rate = RAKO_TX_RATE;
+    int tx_burst = RAKO_TX_BURST;
+    char metrics_address[64] = {0};
+    int metrics_port = 0;
+    int transitions = 0;
+    int verbosity = LOG_NOTICE;
     int option;
+    unsigned long long started = socket_client_now();
 
-    while ((option = getopt(argc, argv,"r:m:u:p:")) != -1) {
+    while ((option = getopt(argc, argv,"r:m:u:p:w:c:s:b:M:l:C:t")) != -1) {
         switch (option) {
         case 'u' :
             strncpy(mqtt_user,optarg,63);
@@ -164,7 +470,55 @@ int main(int argc, char **argv)
             strncpy(mqtt_address,optarg,63);
             break;
         case 'r' :
-            strncpy(rako_address,optarg,63);
+            if (hub_count == RAKO_MAX_HUBS) {
+                log_printf(LOG_ERR,"At most %d hubs can be given with -r\r\n",RAKO_MAX_HUBS);
+                exit(0);
+            }
+            if (strlen(optarg) > 63) {
+                log_printf(LOG_ERR,"Hub address %s is longer than 63 characters\r\n",optarg);
+                exit(0);
+            }
+            memset(rako_address[hub_count],0,64);
+            strncpy(rako_address[hub_count++],optarg,63);
+            break;
+        case 'w' :
+            coalesce_ms = atoi(optarg);
+            break;
+        case 'c' :
+            command_ms = atoi(optarg);
+            break;
+        case 's' :
+            tx_rate = atoi(optarg);
+            break;
+        case 'b' :
+            tx_burst = atoi(optarg);
+            break;
+        case 'M' :
+            // -M takes port or address:port, loopback unless an address is given
+            {
+                char *colon = strrchr(optarg,':');
+                if (colon != NULL) {
+                    strncpy(metrics_address,optarg,sizeof(metrics_address)-1);
+                    if (colon - optarg < (int)sizeof(metrics_address))
+                        metrics_address[colon - optarg] = 0;
+                    metrics_port = atoi(colon+1);
+                } else {
+                    metrics_port = atoi(optarg);
+                }
+            }
+            break;
+        case 'C' :
+            strncpy(cache_dir,optarg,sizeof(cache_dir)-1);
+            break;
+        case 't' :
+            transitions = 1;
+            break;
+        case 'l' :
+            verbosity = log_parse_level(optarg);
+            if (verbosity < 0) {
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
             break;
         default:
             print_usage();
@@ -187,41 +541,104 @@ int main(int argc, char **argv)
         exit(0);
     }
 
-    if (strlen(rako_address) == 0) {
+    if (hub_count == 0) {
         print_usage();
         exit(0);
     }
 
-    openlog ("RAKO_MQTT", LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
+    log_init("RAKO_MQTT",verbosity);
+
+    rako_hub_count = hub_count;
+    for (a=0; a<hub_count; a++) {
+        struct rako_data_t *hub = calloc(1,sizeof(struct rako_data_t));
+
+        if ((hub == NULL) || (idmap_init(&hub->room_slots,64) < 0) || (idmap_init(&hub->channel_slots,256) < 0) ||
+            (topicmap_init(&hub->discovery,RAKO_TOPICS_PER_HUB) < 0)) {
+           log_printf(LOG_ERR,"Out of memory\r\n");
+            log_flush();
+            exit(0);
+        }
+        rako_reset_rooms(hub);
+        strncpy(hub->rako_address,rako_address[a],63);
+        pthread_mutex_init(&hub->cmd_lock,NULL);
+        hub->command_window = command_ms < 0 ? 0 : command_ms;
+        hub->tx_rate = tx_rate < 0 ? 0 : tx_rate;
+        hub->tx_burst = tx_burst < 1 ? 1 : tx_burst;
+        hub->transitions = transitions;
+        // A lone hub needs no id to name its topics
+        if (hub_count == 1)
+            rako_set_prefix(hub);
+        if (cache_dir[0] != 0) {
+            int n = snprintf(hub->cache_path,sizeof(hub->cache_path),"%s/",cache_dir);
+            const char *c;
+
+            for (c=hub->rako_address; *c && (n < (int)sizeof(hub->cache_path)-7); c++)
+                hub->cache_path[n++] = isalnum((unsigned char)*c) ? *c : '_';
+            strcpy(&hub->cache_path[n],".cache");
+        }
+        rako_hubs[a] = hub;
+    }
 
-    rako_data.last_send = -1;
-    rako_data.keepalive_counter=0;
-    strncpy(rako_data.rako_address,rako_address,63);
+   log_printf(LOG_NOTICE,"Connecting to MQTT %s [Username=%s]\r\n",mqtt_address,mqtt_user);
 
-   syslog(LOG_NOTICE,"Connecting to MQTT %s [Username=%s]\r\n",mqtt_address,mqtt_user);
+    if (metrics_port > 0)
+        metrics_start(metrics_address,metrics_port);
 
 
 
+    topicmap_init(&rako_commands,RAKO_TOPICS_PER_HUB*hub_count);
     mqtt_initfuncs();
+    mqtt_set_coalesce(coalesce_ms);
     int rc = mqtt_connect(mqtt_address,CLIENTID,mqtt_user,mqtt_password);
 
     if (rc < 0) {
-       syslog(LOG_NOTICE,"Could not connect to MQTT\r\n");
+       log_printf(LOG_ERR,"Could not connect to MQTT\r\n");
+        log_flush();
         exit(0);
     }
 
 
-    sleep(1);
-    mqtt_register_callback("light/+/set",mqtt_homeassistant_callback,&rako_data);
+    if (mqtt_wait_connected(MQTT_CONNECT_WAIT_MS) < 0)
+       log_printf(LOG_WARNING,"MQTT not connected after %d ms, carrying on\r\n",MQTT_CONNECT_WAIT_MS);
+    // Every hub shares the subscription, the registered target says which hub
+    mqtt_register_callback("light/+/set",mqtt_homeassistant_callback,NULL);
+    mqtt_register_connect(rako_mqtt_connected,NULL);
+
+    // Warm start, commands work and HA keeps its entities while the hub is
+    // queried again in the background. Only changed configs get published.
+    for (a=0; a<hub_count; a++) {
+        if ((rako_cache_load(rako_hubs[a]) == 0) && (rako_hubs[a]->topic_prefix[0] != 0))
+            rako_publish_model(rako_hubs[a]);
+    }
+    rako_view_publish();
+
+    rako_loop = socket_loop_create();
+    if (rako_loop == NULL) {
+       log_printf(LOG_ERR,"Could not create the socket loop\r\n");
+        log_flush();
+        exit(0);
+    }
 
+    for (a=0; a<hub_count; a++) {
+        struct rako_data_t *hub = rako_hubs[a];
+        struct socket_client_t *client = malloc(sizeof(struct socket_client_t));
 
-    rako_data.buffer_ptr=0;
-    rako_data.state=0;
-    setup_socket(&rako_client, (void *)&rako_data);
+        if ((client == NULL) || (json_framer_init(&hub->framer,hub,rako_object_callback) < 0)) {
+           log_printf(LOG_ERR,"Could not allocate the JSON tokener\r\n");
+            log_flush();
+            exit(0);
+        }
+        hub->framer.func_span = rako_span_callback;
+        setup_socket(rako_loop, client, (void *)hub);
+    }
+    socket_loop_start(rako_loop);
 
-    sleep(5);
-    dump_settings(&rako_data);
-  
+    // Nothing else for this thread, other than saying when every hub is usable
+    pthread_mutex_lock(&rako_ready_lock);
+    while (rako_ready_count < hub_count)
+        pthread_cond_wait(&rako_ready_cond,&rako_ready_lock);
+    pthread_mutex_unlock(&rako_ready_lock);
+   log_printf(LOG_NOTICE,"All hubs ready %llu ms after start\r\n",socket_client_now() - started);
 
     while (1) {
         sleep(1);
@@ -229,158 +646,740 @@ int main(int argc, char **argv)
     return 0;
 }
 
+// Looks up the target discovery registered for this command topic, so the
+// topic never has to be taken apart here
 int mqtt_homeassistant_callback(char *node,char *msg, int len, void *p)
 {
 
-    struct rako_data_t *param = p;
-
-    char *tokens[10];
-    char *rako_tokens[5];
-    json_object* rx_json;
-    json_object* returnObj;
-    char *state;
-    char echo_string[45];
-
-    
+    struct rako_data_t *param;
+    struct rako_snapshot_t *view;
+    struct rako_command_t *target;
+    char echo[256];
+    int on;
+    int level;
 
-    
-    
-    
-    int rc = tokenize(tokens,10,node,'/');
 
-    if (rc == 4) {
-        char newstring[128];
-        int level;
+    view = rako_view_enter();
+    target = (view != NULL) ? topicmap_get(&view->commands,node) : NULL;
 
-        //homeassistant/light/rako_%d_%d_%d/state
-         sprintf(echo_string,"%s/%s/%s/state",tokens[0],tokens[1],tokens[2]);
-         mqtt_writedata(echo_string,msg);
-    
+    if ((target == NULL) || (rako_decode_command(msg,len,&on,&level) < 0)) {
+        rako_view_leave();
+        return -1;
+    }
+    param = target->hub;
 
+    // Optimistic echo of the command onto the state topic, msg is not terminated
+    if (len > (int)sizeof(echo)-1)
+        len = sizeof(echo)-1;
+    memcpy(echo,msg,len);
+    echo[len] = 0;
+    mqtt_publish(target->state_topic,echo);
 
-        rx_json = json_tokener_parse(msg);
-        if (json_object_get_type(rx_json) != json_type_object)
-            return -1;
+    if ((target->channel == 0) && (target->scene >= 0)) {
+        int scene = target->scene;
 
-        if(json_object_object_get_ex(rx_json, "state", &returnObj)) {
-            state = json_object_get_string(returnObj);
+        if (on == 0) {
+            scene=0;
         }
 
-        strcpy(newstring,tokens[2]);
-        int rc2 = tokenize(rako_tokens,5,newstring,'_');
+        rako_queue_command(param,target->room,0,scene,0);
+        //update_scene(room,0,scene);
         
-        if (rc2 < 3)
-             return -1;
+    } else {
 
-        if (strcmp(rako_tokens[0],"rako")!=0) {
-            return -1;
+        if (on == 0) {
+            level=0;
+        } else if (level==0) {
+            level=255;
         }
 
+        rako_queue_command(param,target->room,target->channel,-1,level);
+    }
+   log_printf(LOG_DEBUG,"Room %d - Channel %d [scene=%d]\r\n",target->room,target->channel,target->scene);
+    rako_view_leave();
+    return 0;
+}
 
-        int scene=-1;
-        int org_scene = -1;
-        int room = atol(rako_tokens[1]);
-        int channel = atol(rako_tokens[2]);
-        if (channel == 0) {
-            scene = atol(rako_tokens[3]);
-            org_scene=scene;
+// Pulls state and brightness out of a HA JSON light command. Plain payloads
+// are scanned in place, anything else is handed to json-c.
+int rako_decode_command(char *msg, int len, int *on, int *level)
+{
+    const char *state;
+    int state_len;
+    json_tokener *tok;
+    json_object *rx_json;
+    json_object *returnObj;
+    int rc = -1;
+
+    *level = 0;
+
+    if ((fastjson_is_plain(msg,len) == 0) && (fastjson_get_string(msg,len,"state",&state,&state_len) == 0)) {
+        *on = !((state_len == 3) && (memcmp(state,"OFF",3) == 0));
+        fastjson_get_int(msg,len,"brightness",level);
+        return 0;
+    }
 
-            if (strcmp(state,"OFF")==0) {
-                scene=0;
+    tok = json_tokener_new();
+    if (tok == NULL)
+        return -1;
+
+    rx_json = json_tokener_parse_ex(tok,msg,len);
+    if ((rx_json != NULL) && (json_object_get_type(rx_json) == json_type_object)) {
+        if(json_object_object_get_ex(rx_json, "state", &returnObj)) {
+            *on = (strcmp(json_object_get_string(returnObj),"OFF") != 0);
+            if(json_object_object_get_ex(rx_json, "brightness", &returnObj)) {
+                *level = json_object_get_int(returnObj);
             }
+            rc = 0;
+        }
+    }
 
-            param->rooms[room].current_scene=scene;
-            send_scene(param->socket_pvt,room,scene);
-            //update_scene(room,0,scene);
-            
-        } else {
+    if (rx_json != NULL)
+        json_object_put(rx_json);
+    json_tokener_free(tok);
+    return rc;
+}
 
-            if (strcmp(state,"OFF")==0) {
-                level=0;
-            } else {
-                level=0;
-                if(json_object_object_get_ex(rx_json, "brightness", &returnObj)) {
-                    level = json_object_get_int(returnObj);
-                }
-                if (level==0)
-                    level=255;
+// Every hub adds its own change in depth, so the gauge is the total over all
+// of them rather than whichever hub wrote last. Call with cmd_lock held.
+static void rako_command_depth(struct rako_data_t *param)
+{
+    unsigned int depth = param->cmd_tail - param->cmd_head;
+
+    if (depth != param->cmd_depth) {
+        metrics_gauge_add(METRIC_COMMAND_QUEUE_DEPTH,(long)depth - (long)param->cmd_depth);
+        param->cmd_depth = depth;
+    }
+}
+
+// Queues a command for the hub. A level for a channel that is still waiting
+// in the queue replaces the queued value, so a slider drag sends only its
+// latest position once the window expires. Scenes are never merged and
+// flush everything queued ahead of them, keeping their order.
+int rako_queue_command(struct rako_data_t *param, int room, int channel, int scene, int level)
+{
+    unsigned long long now = socket_client_now();
+    struct socket_client_t *sp = param->socket_pvt;
+    unsigned int a;
+
+    pthread_mutex_lock(&param->cmd_lock);
+
+    if (scene < 0) {
+        for (a = param->cmd_tail; a != param->cmd_head; a--) {
+            struct rako_cmd_t *cmd = &param->commands[(a-1) & (RAKO_COMMAND_QUEUE-1)];
+
+            if (cmd->room != room)
+                continue;
+            if (cmd->scene >= 0)
+                break;      // Never move a level across a scene change of its room
+            if (cmd->channel == channel) {
+                cmd->level = level;
+                pthread_mutex_unlock(&param->cmd_lock);
+                metrics_count(METRIC_COMMANDS_MERGED,1);
+                return 0;
             }
+        }
+    }
+
+    if (param->cmd_tail - param->cmd_head >= RAKO_COMMAND_QUEUE) {
+        pthread_mutex_unlock(&param->cmd_lock);
+        metrics_count(METRIC_COMMANDS_DROPPED,1);
+       log_printf(LOG_WARNING,"Command queue full, dropping Room %d - Channel %d\r\n",room,channel);
+        return -1;
+    }
+
+    if (scene >= 0) {
+        for (a = param->cmd_head; a != param->cmd_tail; a++)
+            param->commands[a & (RAKO_COMMAND_QUEUE-1)].due = now;
+    }
+
+    param->commands[param->cmd_tail & (RAKO_COMMAND_QUEUE-1)].room = room;
+    param->commands[param->cmd_tail & (RAKO_COMMAND_QUEUE-1)].channel = channel;
+    param->commands[param->cmd_tail & (RAKO_COMMAND_QUEUE-1)].scene = scene;
+    param->commands[param->cmd_tail & (RAKO_COMMAND_QUEUE-1)].level = level;
+    param->commands[param->cmd_tail & (RAKO_COMMAND_QUEUE-1)].due = (scene >= 0) ? now : now + param->command_window;
+    param->cmd_tail++;
+    metrics_count(METRIC_COMMANDS_QUEUED,1);
+    rako_command_depth(param);
+
+    if (sp != NULL) {
+        unsigned long long due = param->commands[param->cmd_head & (RAKO_COMMAND_QUEUE-1)].due;
+
+        socket_client_timer_start(sp,RAKO_TIMER_COMMANDS,due > now ? due - now : 0,0,rako_command_timer);
+    }
+
+    pthread_mutex_unlock(&param->cmd_lock);
+    return 0;
+}
+
+// Takes one frame from the bucket. Returns 0 when it may be sent, or how
+// many milliseconds until it can.
+static int rako_tx_take(struct rako_data_t *param, unsigned long long now)
+{
+    if (param->tx_rate <= 0)
+        return 0;
+
+    if (now > param->tx_refilled) {
+        unsigned long long add = (now - param->tx_refilled) * param->tx_rate;
+
+        if (add > (unsigned long long)param->tx_burst*1000)
+            add = param->tx_burst*1000;
+        param->tx_tokens += (int)add;
+        if (param->tx_tokens > param->tx_burst*1000)
+            param->tx_tokens = param->tx_burst*1000;
+        param->tx_refilled = now;
+    }
+    if (param->tx_tokens < 1000)
+        return (1000 - param->tx_tokens + param->tx_rate - 1) / param->tx_rate;
+    param->tx_tokens -= 1000;
+    return 0;
+}
+
+// A new connection starts with nothing asked and a full bucket
+void rako_reset_link(struct rako_data_t *param)
+{
+    param->query_head = 0;
+    param->query_tail = 0;
+    param->query_answers = 0;
+    param->awaiting = 0;
+    param->tx_tokens = param->tx_burst*1000;
+    param->tx_refilled = socket_client_now();
+}
 
-            send_level((struct socket_client_t*) param->socket_pvt,room,channel,level);
+// Socket thread only. The same query already waiting is not asked twice.
+int rako_queue_query(struct rako_data_t *param, int type, int room, int pipelined)
+{
+    unsigned int a;
+
+    for (a = param->query_head; a != param->query_tail; a++) {
+        struct rako_query_t *q = &param->queries[a & (RAKO_QUERY_QUEUE-1)];
+
+        if ((q->type == type) && (q->room == room))
+            return 0;
+    }
+    if (param->query_tail - param->query_head >= RAKO_QUERY_QUEUE) {
+       log_printf(LOG_WARNING,"Query queue full, dropping query %d for room %d\r\n",type,room);
+        return -1;
+    }
+
+    param->queries[param->query_tail & (RAKO_QUERY_QUEUE-1)].type = type;
+    param->queries[param->query_tail & (RAKO_QUERY_QUEUE-1)].room = room;
+    param->queries[param->query_tail & (RAKO_QUERY_QUEUE-1)].pipelined = pipelined;
+    param->query_tail++;
+    rako_query_pump(param);
+    return 0;
+}
+
+// Sends queries while no command is queued and the bucket allows. One
+// that is not pipelined also waits until every earlier answer is in.
+// Called again by rako_command_timer once the commands have drained, by
+// rako_query_answered and by rako_query_timer when it had to wait.
+void rako_query_pump(struct rako_data_t *param)
+{
+    struct socket_client_t *sp = param->socket_pvt;
+    unsigned long long now;
+    struct rako_query_t *q;
+    int busy;
+    int wait;
+
+    if (sp == NULL)
+        return;
+
+    now = socket_client_now();
+    if ((param->query_answers > 0) && (now >= param->query_sent + RAKO_QUERY_TIMEOUT_MS)) {
+       log_printf(LOG_WARNING,"%d answers from %s overdue, asking the next\r\n",param->query_answers,sp->host);
+        param->query_answers = 0;
+    }
+
+    while (param->query_head != param->query_tail) {
+        q = &param->queries[param->query_head & (RAKO_QUERY_QUEUE-1)];
+
+        pthread_mutex_lock(&param->cmd_lock);
+        busy = (param->cmd_head != param->cmd_tail);
+        pthread_mutex_unlock(&param->cmd_lock);
+        if (busy) {
+            metrics_count(METRIC_QUERIES_DEFERRED,1);
+            return;
+        }
+
+        if ((q->pipelined == 0) && (param->query_answers > 0)) {
+            socket_client_timer_start(sp,RAKO_TIMER_QUERIES,(int)(param->query_sent + RAKO_QUERY_TIMEOUT_MS - now),0,rako_query_timer);
+            return;
+        }
+
+        wait = rako_tx_take(param,now);
+        if (wait > 0) {
+            socket_client_timer_start(sp,RAKO_TIMER_QUERIES,wait,0,rako_query_timer);
+            metrics_count(METRIC_TX_THROTTLED,1);
+            return;
         }
-       syslog(LOG_NOTICE,"Room %d - Channel %d [scene=%d]\r\n",room,channel,scene);
+
+        param->query_head++;
+        if (q->type == RAKO_QUERY_ROOM)
+            send_room_request(sp);
+        else if (q->type == RAKO_QUERY_CHANNEL)
+            send_channel_request(sp);
+        else if (q->room != 0)
+            send_room_level_request(sp,q->room);
+        else
+            send_level_request(sp);
+        param->query_answers++;
+        param->query_sent = now;
+        // Moves the rest along should the answers never come
+        socket_client_timer_start(sp,RAKO_TIMER_QUERIES,RAKO_QUERY_TIMEOUT_MS,0,rako_query_timer);
     }
 }
 
-void setup_socket(struct socket_client_t *rako_sock, void *pvt)
+int rako_query_timer(void *pvt,struct socket_client_t* sp)
 {
-    memset(rako_sock,0,sizeof(struct socket_client_t));
-    rako_sock->pvt = pvt;
+    rako_query_pump(pvt);
+    return 0;
+}
 
+// Caller holds cmd_lock. A group or automation switching a whole room
+// arrives as one level per channel within the same window. When the level
+// command at 'at' and those queued behind it set every channel of its room
+// to one level they become a single channel 0 command, and when every room
+// is covered like that a single command for room 0, the house.
+static void rako_fan_in(struct rako_data_t *param, unsigned int at)
+{
+    struct rako_cmd_t *first = &param->commands[at & (RAKO_COMMAND_QUEUE-1)];
+    struct rooms_t *rm;
+    unsigned int a, end;
+    int house = 1;
+    int rooms = 0;
+    int folded = 0;
+    int b;
+
+    for (b=0; b<param->room_count; b++)
+        param->rooms[b].fan_in = 0;
+
+    // Everything up to the next scene or different level for the room
+    for (end = at; end != param->cmd_tail; end++) {
+        struct rako_cmd_t *cmd = &param->commands[end & (RAKO_COMMAND_QUEUE-1)];
+
+        if (cmd->room < 0)
+            continue;
+        rm = rako_find_room(param,cmd->room);
+        if ((rm == NULL) || (cmd->scene >= 0) || (cmd->level != first->level)) {
+            house = 0;
+            if (cmd->room == first->room)
+                break;
+            continue;
+        }
+        if (cmd->channel == 0)
+            rm->fan_in = rm->channel_count;
+        else if (rako_find_channel(param,cmd->room,cmd->channel) != NULL)
+            rm->fan_in++;
+    }
+
+    for (b=0; house && (b<param->room_count); b++) {
+        rm = &param->rooms[b];
+        if ((rm->room_id == 0) || (rm->channel_count == 0))
+            continue;
+        if (rm->fan_in < rm->channel_count)
+            house = 0;
+        rooms++;
+    }
+
+    if (house && (rooms > 1)) {
+        for (a = at+1; a != param->cmd_tail; a++) {
+            if (param->commands[a & (RAKO_COMMAND_QUEUE-1)].room >= 0)
+                folded++;
+            param->commands[a & (RAKO_COMMAND_QUEUE-1)].room = -1;
+        }
+        first->room = 0;
+        first->channel = 0;
+        metrics_count(METRIC_COMMANDS_FOLDED,folded);
+       log_printf(LOG_DEBUG,"House to level %d in one command, %d folded\r\n",first->level,folded);
+        return;
+    }
+
+    rm = rako_find_room(param,first->room);
+    if ((rm == NULL) || (rm->channel_count < 2) || (rm->fan_in < rm->channel_count))
+        return;
+
+    for (a = at+1; a != end; a++) {
+        struct rako_cmd_t *cmd = &param->commands[a & (RAKO_COMMAND_QUEUE-1)];
+
+        if (cmd->room == first->room) {
+            cmd->room = -1;
+            folded++;
+        }
+    }
+    first->channel = 0;
+    metrics_count(METRIC_COMMANDS_FOLDED,folded);
+   log_printf(LOG_DEBUG,"Room %d to level %d in one command, %d folded\r\n",first->room,first->level,folded);
+}
+
+// Sends every queued command whose window has passed, then rearms for the next one
+int rako_command_timer(void *pvt,struct socket_client_t* sp)
+{
     struct rako_data_t *param = pvt;
+    unsigned long long now = socket_client_now();
+    int wait;
 
+    pthread_mutex_lock(&param->cmd_lock);
 
-    rako_sock->port = 9762;
-    strcpy(rako_sock->host,param->rako_address);
+    while (param->cmd_head != param->cmd_tail) {
+        struct rako_cmd_t *cmd = &param->commands[param->cmd_head & (RAKO_COMMAND_QUEUE-1)];
 
-    rako_sock->func_idle=(void *)rako_idle_callback;
-    rako_sock->func_connected=(void *)rako_connect_callback;
-    rako_sock->func_parse=(void *)rako_parse_callback;
+        if (cmd->room < 0) {
+            param->cmd_head++;
+            continue;
+        }
 
-    socket_client_start(rako_sock);
+        if (cmd->due > now) {
+            socket_client_timer_start(sp,RAKO_TIMER_COMMANDS,cmd->due - now,0,rako_command_timer);
+            break;
+        }
 
-    return;
+        if ((cmd->scene < 0) && (cmd->room != 0))
+            rako_fan_in(param,param->cmd_head);
+
+        wait = rako_tx_take(param,now);
+        if (wait > 0) {
+            socket_client_timer_start(sp,RAKO_TIMER_COMMANDS,wait,0,rako_command_timer);
+            metrics_count(METRIC_TX_THROTTLED,1);
+            break;
+        }
+
+        if (cmd->scene >= 0) {
+            send_scene(sp,cmd->room,cmd->scene);
+            rako_set_scene(param,cmd->room,cmd->scene);
+            rako_predict_scene(param,cmd->room,cmd->scene);
+        } else
+            send_level(sp,cmd->room,cmd->channel,cmd->level);
+        param->cmd_head++;
+        metrics_count(METRIC_COMMANDS_SENT,1);
+    }
+    rako_command_depth(param);
+
+    pthread_mutex_unlock(&param->cmd_lock);
+
+    // Predicted scene levels go out now rather than with the next hub frame
+    rako_publish_dirty(param);
+    // Queries held back for the commands
+    rako_query_pump(param);
+    return 0;
 }
 
+// Called while discovery is published, base is homeassistant/light/<prefix>_...
+// The MQTT thread sees new topics once rako_view_publish() runs.
+void rako_register_command(struct rako_data_t *param, const char *base, int roomid, int channel_id, int scene)
+{
+    struct rako_command_t *target;
+    char topic[128];
+
+    if (roomid < 0)
+        return;
+
+    sprintf(topic,"%s/set",base);
+
+    if (topicmap_get(&rako_commands,topic) == NULL) {
+        target = malloc(sizeof(struct rako_command_t));
+        target->hub = param;
+        target->room = roomid;
+        target->channel = channel_id;
+        target->scene = scene;
+        snprintf(target->state_topic,sizeof(target->state_topic),"%s/state",base);
+        topicmap_insert(&rako_commands,topic,target);
+    }
+}
 
+// Readers bracket every use of a snapshot with enter/leave and never keep
+// a pointer into it afterwards
+struct rako_snapshot_t *rako_view_enter(void)
+{
+    __atomic_add_fetch(&rako_view_readers,1,__ATOMIC_SEQ_CST);
+    return __atomic_load_n(&rako_view,__ATOMIC_SEQ_CST);
+}
 
-int rako_idle_callback(void *pvt,struct socket_client_t* sp)
+void rako_view_leave(void)
 {
+    __atomic_sub_fetch(&rako_view_readers,1,__ATOMIC_RELEASE);
+}
 
-    struct rako_data_t *param = pvt;
+struct rako_snapshot_hub_t *rako_view_hub(struct rako_snapshot_t *view, struct rako_data_t *param)
+{
+    int a;
 
+    if (view == NULL)
+        return NULL;
+    for (a=0; a<rako_hub_count; a++) {
+        if (view->hubs[a].hub == param)
+            return &view->hubs[a];
+    }
+    return NULL;
+}
 
-    if (param->last_send > 0)
-    {
-       param->last_send--; 
-    } else if (param->last_send==0)
-    {
-        param->last_send=-1;
-        return -1;
+static void rako_view_free(struct rako_snapshot_t *view)
+{
+    struct topicmap_entry_t *e, *next;
+    unsigned int bucket;
+    int a,b;
+
+    for (bucket=0; bucket<view->commands.size; bucket++) {
+        for (e=view->commands.buckets[bucket]; e!=NULL; e=next) {
+            next = e->next;
+            free(e->value);
+            free(e->topic);
+            free(e);
+        }
     }
+    free(view->commands.buckets);
 
+    for (a=0; a<rako_hub_count; a++) {
+        for (b=0; b<view->hubs[a].room_count; b++)
+            free(view->hubs[a].rooms[b].channels);
+        free(view->hubs[a].rooms);
+    }
+    free(view);
+}
 
-    if (param->state == 1) {
-        socket_client_write(sp,"\r\n{\"name\":\"status\",\"payload\":{}}\r\n",33);
-        param->state++;
-    } else if (param->state==2) {
-        send_room_request(sp);
-        param->state++;
-    } else if (param->state==3) {
-        send_channel_request(sp);
-        param->state++;
-    } else if (param->state==4) {
-        send_level_request(sp);
-        param->state++;
+// Frees replaced snapshots once nobody can still be reading them. Anyone
+// who entered after a swap got the newer pointer, so a reader count of
+// zero seen after the swap is enough.
+void rako_view_reclaim(void)
+{
+    struct rako_snapshot_t *view;
+
+    if ((rako_view_retired == NULL) || (__atomic_load_n(&rako_view_readers,__ATOMIC_SEQ_CST) != 0))
+        return;
+
+    while (rako_view_retired != NULL) {
+        view = rako_view_retired;
+        rako_view_retired = view->retired_next;
+        rako_view_free(view);
+    }
+}
+
+// Copies the command map and every hub's rooms into a new snapshot and
+// swaps it in. Runs on the socket thread, or on main before the loop starts.
+void rako_view_publish(void)
+{
+    struct rako_snapshot_t *view = calloc(1,sizeof(struct rako_snapshot_t));
+    struct rako_snapshot_t *old;
+    struct topicmap_entry_t *e;
+    unsigned int bucket;
+    int a,b;
+
+    if ((view == NULL) || (topicmap_init(&view->commands,rako_commands.count) < 0)) {
+       log_printf(LOG_ERR,"Out of memory publishing the model\r\n");
+        free(view);
+        return;
     }
 
+    TOPICMAP_FOREACH(&rako_commands,bucket,e) {
+        struct rako_command_t *target = malloc(sizeof(struct rako_command_t));
 
-    param->counter++;
-    param->keepalive_counter++;
-    
-    if (param->keepalive_counter == 1000) {
+        if (target == NULL)
+            continue;
+        *target = *(struct rako_command_t *)e->value;
+        topicmap_insert(&view->commands,e->topic,target);
+    }
+
+    for (a=0; a<rako_hub_count; a++) {
+        struct rako_data_t *param = rako_hubs[a];
+        struct rako_snapshot_hub_t *model = &view->hubs[a];
+
+        model->hub = param;
+        model->rooms = malloc((param->room_count ? param->room_count : 1) * sizeof(struct rooms_t));
+        if (model->rooms == NULL)
+            continue;
+        for (b=0; b<param->room_count; b++) {
+            struct rooms_t *rm = &model->rooms[b];
+
+            *rm = param->rooms[b];
+            rm->channel_alloc = rm->channel_count;
+            rm->channels = malloc((rm->channel_count ? rm->channel_count : 1) * sizeof(struct channels_t));
+            if (rm->channels == NULL) {
+                rm->channel_count = 0;
+                continue;
+            }
+            memcpy(rm->channels,param->rooms[b].channels,rm->channel_count * sizeof(struct channels_t));
+        }
+        model->room_count = param->room_count;
+    }
+
+    old = __atomic_exchange_n(&rako_view,view,__ATOMIC_SEQ_CST);
+    if (old != NULL) {
+        old->retired_next = rako_view_retired;
+        rako_view_retired = old;
+    }
+    rako_view_reclaim();
+}
+
+void setup_socket(struct socket_loop_t *loop, struct socket_client_t *rako_sock, void *pvt)
+{
+    memset(rako_sock,0,sizeof(struct socket_client_t));
+    rako_sock->pvt = pvt;
+
+    struct rako_data_t *param = pvt;
+    // Set before the loop or MQTT can look at it, and never changed
+    param->socket_pvt = rako_sock;
+
+
+    // -r takes host or host:port, the hub itself always listens on 9762.
+    // host is as large as rako_address, so nothing is cut off before the split.
+    char *colon;
+    snprintf(rako_sock->host,sizeof(rako_sock->host),"%s",param->rako_address);
+    colon = strrchr(rako_sock->host,':');
+    if (colon != NULL) {
+        *colon = 0;
+        rako_sock->port = atoi(colon+1);
+    } else {
+        rako_sock->port = 9762;
+    }
+
+    rako_sock->func_connected=(void *)rako_connect_callback;
+    rako_sock->func_parse=(void *)rako_parse_callback;
+
+    socket_loop_add(loop,rako_sock);
+
+    return;
+}
+
+
+
+// Asks for everything at once and matches the answers by name as they
+// arrive. With several hubs the topics are named after the status reply;
+// a CHANNEL answer that gets in first only builds the model, which
+// rako_set_prefix then publishes. A resumed session only asks for the levels.
+void rako_start_discovery(struct rako_data_t *param, int full)
+{
+    struct socket_client_t *sp = param->socket_pvt;
+
+    param->discovery_started = metrics_now_us();
+    if (full) {
+        param->awaiting = (1u << RAKO_QUERY_STATUS) | (1u << RAKO_QUERY_ROOM) |
+                          (1u << RAKO_QUERY_CHANNEL) | (1u << RAKO_QUERY_LEVEL);
         socket_client_write(sp,"\r\n{\"name\":\"status\",\"payload\":{}}\r\n",33);
-        param->keepalive_counter=0;
-        param->last_send=500;
+        rako_queue_query(param,RAKO_QUERY_ROOM,0,1);
+        rako_queue_query(param,RAKO_QUERY_CHANNEL,0,1);
+    } else {
+        param->awaiting = 1u << RAKO_QUERY_LEVEL;
     }
+    rako_queue_query(param,RAKO_QUERY_LEVEL,0,1);
+}
 
-    if (param->counter == 30000) {
-        param->state=4;
-        param->counter=0;
+// The last answer discovery waited for has been parsed
+static void rako_discovery_done(struct rako_data_t *param)
+{
+    unsigned long long ms = (metrics_now_us() - param->discovery_started) / 1000;
+
+    metrics_observe_since(METRIC_HUB_DISCOVERY,param->discovery_started);
+    if (param->ready) {
+       log_printf(LOG_INFO,"Hub %s discovered again in %llu ms\r\n",param->rako_address,ms);
+        return;
     }
 
+   log_printf(LOG_NOTICE,"Hub %s ready in %llu ms, %d rooms and %d channels\r\n",param->rako_address,ms,param->room_count,param->channel_total);
+    param->ready = 1;
+    pthread_mutex_lock(&rako_ready_lock);
+    rako_ready_count++;
+    pthread_cond_broadcast(&rako_ready_cond);
+    pthread_mutex_unlock(&rako_ready_lock);
+}
 
-    usleep(10000);
+// Matches an answer to what was asked by its name
+void rako_query_answered(struct rako_data_t *param, int type)
+{
+    unsigned int awaiting = param->awaiting;
+
+    // Keepalive status frames are written directly and not counted
+    if ((type != RAKO_QUERY_STATUS) && (param->query_answers > 0))
+        param->query_answers--;
+
+    param->awaiting &= ~(1u << type);
+    if ((awaiting != 0) && (param->awaiting == 0))
+        rako_discovery_done(param);
+
+    rako_query_pump(param);
+}
+
+int rako_keepalive_timer(void *pvt,struct socket_client_t* sp)
+{
+    socket_client_write(sp,"\r\n{\"name\":\"status\",\"payload\":{}}\r\n",33);
+    // parse_status cancels this when the hub answers
+    socket_client_timer_start(sp,RAKO_TIMER_WATCHDOG,RAKO_WATCHDOG_MS,0,rako_watchdog_timer);
+    return 0;
+}
+
+int rako_watchdog_timer(void *pvt,struct socket_client_t* sp)
+{
+    log_printf(LOG_WARNING,"No status reply from the hub %s, reconnecting\r\n",sp->host);
+    return -1;
+}
+
+int rako_refresh_timer(void *pvt,struct socket_client_t* sp)
+{
+    rako_queue_query(pvt,RAKO_QUERY_LEVEL,0,0);
+    return 0;
+}
+
+// Runs the whole discovery again unless it is already under way
+int rako_rediscover_timer(void *pvt,struct socket_client_t* sp)
+{
+    struct rako_data_t *param = pvt;
+
+    // Answers missing for longer than a query may take are not coming
+    if ((param->awaiting == 0) || (metrics_now_us() - param->discovery_started > RAKO_QUERY_TIMEOUT_MS*1000ULL))
+        rako_start_discovery(param,1);
+    return 0;
+}
+
+// Reads back the rooms whose fades have ended, then waits for the next end
+int rako_fade_timer(void *pvt,struct socket_client_t* sp)
+{
+    struct rako_data_t *param = pvt;
+    unsigned long long now = socket_client_now();
+    unsigned long long next = 0;
+    int rooms = 0;
+    int a,b;
+
+    for (a=0; a<param->room_count; a++) {
+        struct rooms_t *rm = &param->rooms[a];
+
+        for (b=0; b<rm->channel_count; b++) {
+            struct channels_t *ch = &rm->channels[b];
+
+            if (ch->fade_due == 0)
+                continue;
+            if (ch->fade_due > now + RAKO_FADE_GRACE_MS) {
+                if ((next == 0) || (ch->fade_due < next))
+                    next = ch->fade_due;
+                continue;
+            }
+            // Assume it landed, the LEVEL answer corrects it if not
+            ch->fade_due = 0;
+            ch->current_level = ch->target_level;
+            if (rm->fade_check == 0) {
+                rm->fade_check = 1;
+                rooms++;
+            }
+        }
+    }
+
+    if (rooms > RAKO_FADE_ROOM_QUERIES) {
+        rako_queue_query(param,RAKO_QUERY_LEVEL,0,0);
+        metrics_count(METRIC_FADE_QUERIES,1);
+    }
+    for (a=0; (rooms > 0) && (a<param->room_count); a++) {
+        struct rooms_t *rm = &param->rooms[a];
+
+        if (rm->fade_check == 0)
+            continue;
+        rm->fade_check = 0;
+        if (rooms <= RAKO_FADE_ROOM_QUERIES) {
+            rako_queue_query(param,RAKO_QUERY_LEVEL,rm->room_id,0);
+            metrics_count(METRIC_FADE_QUERIES,1);
+        }
+    }
+
+    param->fade_due = next;
+    if (next != 0)
+        socket_client_timer_start(sp,RAKO_TIMER_FADE,(int)(next - now) + RAKO_FADE_GRACE_MS,0,rako_fade_timer);
     return 0;
 }
 
@@ -389,11 +1388,29 @@ int rako_connect_callback(void *pvt, struct socket_client_t* sp, int fd)
 {
     struct rako_data_t *param = pvt;
 
-    param->socket_pvt=sp;
     char conn[] = {"SUB,JSON,{\"version\": 2, \"client_name\":\"HA_CLIENT\", \"subscriptions\":[\"TRACKER\",\"FEEDBACK\"] }\r\n\0" };
 
+    json_framer_reset(&param->framer);
+    rako_reset_link(param);
     socket_client_write(sp,conn,strlen(conn)+2);
-    param->state = 1;
+
+    // The model survived the drop, after a hub reboot only the levels can
+    // have moved
+    if (param->discovered)
+       log_printf(LOG_INFO,"Resuming %s, reading levels only\r\n",sp->host);
+    rako_start_discovery(param,param->discovered == 0);
+
+    socket_client_timer_start(sp,RAKO_TIMER_KEEPALIVE,RAKO_KEEPALIVE_MS,RAKO_KEEPALIVE_MS,rako_keepalive_timer);
+    socket_client_timer_start(sp,RAKO_TIMER_REFRESH,RAKO_REFRESH_MS,RAKO_REFRESH_MS,rako_refresh_timer);
+    socket_client_timer_start(sp,RAKO_TIMER_REDISCOVER,RAKO_REDISCOVER_MS,RAKO_REDISCOVER_MS,rako_rediscover_timer);
+    // Fades from before the drop are covered by the LEVEL query above
+    rako_reset_fades(param);
+
+    // Commands taken from HA while the hub was away
+    pthread_mutex_lock(&param->cmd_lock);
+    if (param->cmd_head != param->cmd_tail)
+        socket_client_timer_start(sp,RAKO_TIMER_COMMANDS,0,0,rako_command_timer);
+    pthread_mutex_unlock(&param->cmd_lock);
     return 0;
 }
 
@@ -402,57 +1419,74 @@ int rako_connect_callback(void *pvt, struct socket_client_t* sp, int fd)
 int rako_parse_callback(void *pvt,struct socket_client_t* sp,int fd, char* buffer, int len)
 {
     struct rako_data_t *param = pvt;
-    json_object* returnObj;
-    char *name;
-
-
-    if ((buffer[0] != 0x0d) && (buffer[0] != 0x0a)) {
-        memcpy(param->buffer+param->buffer_ptr,buffer,len);
-        param->buffer_ptr = param->buffer_ptr+len;
-    }
-    if ((buffer[0] == 0x0d) || (buffer[0] == 0x0a)) {
-        if (param->buffer_ptr < 5) {
-            param->buffer_ptr=0;
-            return -1;
-        }
+    unsigned long long start = metrics_now_us();
 
-        param->rx_json = json_tokener_parse(param->buffer);
-        if (json_object_get_type(param->rx_json) != json_type_object) {
-            param->buffer_ptr=0;
-            return -1;
-        }
+    json_framer_feed(&param->framer,buffer,len);
+    // One pass per chunk, so a burst of tracker events publishes each channel once
+    rako_publish_dirty(param);
+    metrics_observe_since(METRIC_HUB_CHUNK,start);
+    return 0;
+}
 
+// Called by the framer for every complete object, the framer owns obj
+int rako_object_callback(void *pvt, json_object *obj)
+{
+    struct rako_data_t *param = pvt;
+    struct socket_client_t *sp = param->socket_pvt;
+    json_object* returnObj;
+    const char *name = NULL;
+    unsigned long long start = metrics_now_us();
+    int metric = METRIC_PARSE_OTHER;
 
-        if(json_object_object_get_ex(param->rx_json, "name", &returnObj)) {
-            name = json_object_get_string(returnObj);
-            if (name == NULL) {
 
-                json_object_put(param->rx_json);
-                param->buffer_ptr=0;
-                return -1;
-            }
-        }
+    metrics_count(METRIC_HUB_FRAMES_JSON,1);
+    if (json_object_get_type(obj) != json_type_object)
+        return -1;
 
+    if(json_object_object_get_ex(obj, "name", &returnObj)) {
+        name = json_object_get_string(returnObj);
+    }
+    if (name == NULL)
+        return -1;
 
-        if (strcmp(name,"status") == 0)
-            parse_status(pvt,sp);
-        if (strcmp(name,"query_ROOM") == 0)
-            parse_query_room(pvt,sp);
-        if (strcmp(name,"query_CHANNEL") == 0)
-            parse_query_channel(pvt,sp);
-        if (strcmp(name,"query_LEVEL") == 0)
-            parse_query_levels(pvt,sp);
-        if (strcmp(name,"tracker") == 0)
-            parse_tracker(pvt,sp);
-        if (strcmp(name,"feedback") == 0)
-            parse_feedback(pvt,sp);
+    param->rx_json = obj;
 
-        memset(param->buffer,0,32768*4);
-        param->buffer_ptr=0;
-        json_object_put(param->rx_json);
+    if (strcmp(name,"status") == 0) {
+        parse_status(pvt,sp);
+        metric = METRIC_PARSE_STATUS;
+    }
+    if (strcmp(name,"query_ROOM") == 0) {
+        parse_query_room(pvt,sp);
+        metric = METRIC_PARSE_QUERY_ROOM;
+    }
+    if (strcmp(name,"query_CHANNEL") == 0) {
+        parse_query_channel(pvt,sp);
+        metric = METRIC_PARSE_QUERY_CHANNEL;
+    }
+    if (strcmp(name,"query_LEVEL") == 0) {
+        parse_query_levels(pvt,sp);
+        metric = METRIC_PARSE_QUERY_LEVEL;
+    }
+    if (strcmp(name,"tracker") == 0) {
+        parse_tracker(pvt,sp);
+        metric = METRIC_PARSE_TRACKER;
+    }
+    if (strcmp(name,"feedback") == 0) {
+        parse_feedback(pvt,sp);
+        metric = METRIC_PARSE_FEEDBACK;
     }
 
-
+    param->rx_json = NULL;
+    metrics_observe_since(metric,start);
+
+    if (metric == METRIC_PARSE_STATUS)
+        rako_query_answered(param,RAKO_QUERY_STATUS);
+    else if (metric == METRIC_PARSE_QUERY_ROOM)
+        rako_query_answered(param,RAKO_QUERY_ROOM);
+    else if (metric == METRIC_PARSE_QUERY_CHANNEL)
+        rako_query_answered(param,RAKO_QUERY_CHANNEL);
+    else if (metric == METRIC_PARSE_QUERY_LEVEL)
+        rako_query_answered(param,RAKO_QUERY_LEVEL);
     return 0;
 }
 
@@ -492,8 +1526,16 @@ void send_channel_request(struct socket_client_t* sp)
 
 void send_level_request(struct socket_client_t* sp)
 {
-    char channel[] = { "\r\n{ \"name\": \"query\",\"payload\": { \"queryType\": \"LEVEL\",\"roomId\": 0}}\r\n"};
-    socket_client_write(sp,channel,strlen(channel)+2);
+    char channel[] = { "\r\n{ \"name\": \"query\",\"payload\": { \"queryType\": \"LEVEL\",\"roomId\": 0}}\r\n"};
+    socket_client_write(sp,channel,strlen(channel)+2);
+    return;
+}
+
+void send_room_level_request(struct socket_client_t* sp, int roomid)
+{
+    char channel[128];
+    int n = sprintf(channel,"\r\n{ \"name\": \"query\",\"payload\": { \"queryType\": \"LEVEL\",\"roomId\": %d}}\r\n",roomid);
+    socket_client_write(sp,channel,n+2);
     return;
 }
 
@@ -521,27 +1563,30 @@ int parse_query_levels(void *pvt, struct socket_client_t *sp)
             json_object_object_get_ex(itemObj, "currentScene", &valueObj);
             int scene = json_object_get_int(valueObj);
 
-            update_scene(index,0,scene);
-
-
-            if (index > MAX_ROOMS)
-                continue;
-            if (param->rooms[index].enabled!=1)
+            struct rooms_t *rm = rako_find_room(param,index);
+            if (rm == NULL)
                 continue;
+            rako_set_scene(param,index,scene);
+
             json_object_object_get_ex(itemObj, "channel", &levelsArrayObj);
             int levelArrayCount = json_object_array_length(levelsArrayObj);
-           syslog(LOG_NOTICE,"Room %d  %s\r\n",index,param->rooms[index].room_name);
+           log_dump(LOG_INFO,"Room %d  %s\r\n",index,rm->room_name);
 
             for (p=0; p<levelArrayCount; p++) {
                 levelsObj  = json_object_array_get_idx(levelsArrayObj, p);
                 json_object_object_get_ex(levelsObj, "channelId", &valueObj);
                 int channelid = json_object_get_int(valueObj);
-                if (param->rooms[index].channels[channelid].enabled != 1)
+                if (rako_find_channel(param,index,channelid) == NULL)
                     continue;
                 json_object_object_get_ex(levelsObj, "currentLevel", &valueObj);
                 int level = json_object_get_int(valueObj);
-               syslog(LOG_NOTICE,"\tChannel %d Level=%d\r\n",channelid,level);
-                publish_state(index,channelid,level);
+                int target = level;
+                // targetLevel is null unless a fade is running
+                if (json_object_object_get_ex(levelsObj, "targetLevel", &valueObj) &&
+                    (json_object_get_type(valueObj) == json_type_int))
+                    target = json_object_get_int(valueObj);
+               log_dump(LOG_DEBUG,"\tChannel %d Level=%d\r\n",channelid,level);
+                rako_set_level(param,index,channelid,level,target);
             }
         }
     }
@@ -566,12 +1611,18 @@ int parse_query_channel(void *pvt, struct socket_client_t *sp)
     rc = json_object_object_get_ex(param->rx_json, "payload", &returnObj);
     if (rc == 1) {
         int arraylen = json_object_array_length(returnObj);
+        param->discovery_generation++;
         for (i = 0; i < arraylen; i++) {
             itemObj  = json_object_array_get_idx(returnObj, i);
             json_object_object_get_ex(itemObj, "roomId", &valueObj);
             int index = json_object_get_int(valueObj);
 
-            publish_scene(index,0,param->rooms[index].room_name,param->rooms[index].room_name);
+            struct rooms_t *rm = rako_find_room(param,index);
+            if (rm == NULL) {
+               log_printf(LOG_INFO,"Channels for unknown room %d ignored\r\n",index);
+                continue;
+            }
+            publish_scene(param,index,0,rm->room_name,rm->room_name);
 
 
 
@@ -584,23 +1635,49 @@ int parse_query_channel(void *pvt, struct socket_client_t *sp)
                     json_object_object_get_ex(channel_itemObj, "channelId", &chObj);
                     int channel_num = json_object_get_int(chObj);
 
-                    param->rooms[index].channels[channel_num].enabled=1;
+                    struct channels_t *ch = rako_add_channel(param,rm,channel_num);
+                    if (ch == NULL)
+                        continue;
 
                     json_object_object_get_ex(channel_itemObj, "title", &chObj);
                     char *v = json_object_get_string(chObj);
-                    strncpy(param->rooms[index].channels[channel_num].channel_name,v,31);
+                    strncpy(ch->channel_name,v,31);
 
                     json_object_object_get_ex(channel_itemObj, "type", &chObj);
                     v = json_object_get_string(chObj);
-                    strncpy(param->rooms[index].channels[channel_num].channel_type,v,31);
+                    strncpy(ch->channel_type,v,31);
 
-                    publish_discovery(index,channel_num,param->rooms[index].room_name,param->rooms[index].channels[channel_num].channel_name);
+                    // Level of this channel for each scene, lets a scene change be shown at once
+                    if (json_object_object_get_ex(channel_itemObj, "sceneLevels", &chObj) &&
+                        (json_object_get_type(chObj) == json_type_array)) {
+                        int q, levels = json_object_array_length(chObj);
+
+                        if (levels > RAKO_SCENE_LEVELS)
+                            levels = RAKO_SCENE_LEVELS;
+                        for (q=0; q<levels; q++)
+                            ch->scene_levels[q] = json_object_get_int(json_object_array_get_idx(chObj,q));
+                        ch->has_scene_levels = (levels > 0);
+                    }
+
+                    publish_discovery(param,index,channel_num,rm->room_name,ch->channel_name);
 
                 }
             }
+            publish_room(param,index,rm->room_name);
+        }
+        param->discovered = 1;
+        if (param->topic_prefix[0] != 0) {
+            rako_discovery_sweep(param);
+            rako_cache_save(param);
+        } else {
+            param->publish_pending = 1;
         }
+        rako_view_publish();
+        dump_settings(param);
         rc = 0;
     }
+
+    return rc;
 }
 
 int parse_query_room(void *pvt, struct socket_client_t *sp)
@@ -614,25 +1691,31 @@ int parse_query_room(void *pvt, struct socket_client_t *sp)
     json_object *itemObj;
     json_object *valueObj;
 
-    memset(&param->rooms,0,sizeof(struct rooms_t)* MAX_ROOMS);
+    // Only a well formed answer replaces the rooms already known
     rc = json_object_object_get_ex(param->rx_json, "payload", &returnObj);
-    if (rc == 1) {
+    if ((rc == 1) && (json_object_get_type(returnObj) == json_type_array)) {
         int arraylen = json_object_array_length(returnObj);
+
+        rako_reset_rooms(param);
         for (i = 0; i < arraylen; i++) {
             itemObj  = json_object_array_get_idx(returnObj, i);
             json_object_object_get_ex(itemObj, "roomId", &valueObj);
             int index = json_object_get_int(valueObj);
 
-            param->rooms[index].enabled = 1;
+            struct rooms_t *rm = rako_add_room(param,index);
+            if (rm == NULL)
+                continue;
             json_object_object_get_ex(itemObj, "title", &valueObj);
             value = json_object_get_string(valueObj);
-            strncpy(param->rooms[index].room_name,value,63);
+            strncpy(rm->room_name,value,63);
 
             json_object_object_get_ex(itemObj, "type", &valueObj);
             value = json_object_get_string(valueObj);
-            strncpy(param->rooms[index].device_type,value,31);
+            strncpy(rm->device_type,value,31);
         }
         rc = 0;
+    } else {
+        rc = -1;
     }
 
     return rc;
@@ -646,7 +1729,7 @@ int parse_status(void *pvt, struct socket_client_t *sp)
     json_object *returnObj;
     json_object *valueObj;
 
-   syslog(LOG_NOTICE,"Got Status....its ALIVE!\r\n");
+   log_printf(LOG_DEBUG,"Got Status....its ALIVE!\r\n");
     rc = json_object_object_get_ex(param->rx_json, "payload", &returnObj);
     if (rc == 1) {
         char *value;
@@ -667,7 +1750,9 @@ int parse_status(void *pvt, struct socket_client_t *sp)
         value = json_object_get_string(valueObj);
         strncpy(param->hub_version,value,15);
 
-        param->last_send=-1;
+        rako_set_prefix(param);
+
+        socket_client_timer_stop(sp,RAKO_TIMER_WATCHDOG);
         rc = 0;
     }
 
@@ -681,10 +1766,9 @@ int parse_status(void *pvt, struct socket_client_t *sp)
 int parse_tracker(void *pvt, struct socket_client_t *sp)
 {
     int rc = -1;
-    int i;
-    char *value;
 
     struct rako_data_t *param = pvt;
+    struct rako_tracker_t event;
     json_object *returnObj;
     //json_object *itemObj;
     json_object *valueObj;
@@ -693,31 +1777,48 @@ int parse_tracker(void *pvt, struct socket_client_t *sp)
     json_object_object_get_ex(param->rx_json, "payload", &returnObj);
     if (json_object_get_type(returnObj) == json_type_object) {
         json_object_object_get_ex(returnObj, "roomId", &valueObj);
-        int index = json_object_get_int(valueObj);
+        event.room = json_object_get_int(valueObj);
 
         json_object_object_get_ex(returnObj, "channelId", &valueObj);
-        int channel = json_object_get_int(valueObj);
+        event.channel = json_object_get_int(valueObj);
+
+        json_object_object_get_ex(returnObj, "currentLevel", &valueObj);
+        event.current_level = json_object_get_int(valueObj);
 
         json_object_object_get_ex(returnObj, "targetLevel", &valueObj);
+        event.target_level = json_object_get_int(valueObj);
 
-        int level = json_object_get_int(valueObj);
-       syslog(LOG_NOTICE,"Room %d - Channel %d - Target %d\r\n",index,channel,level);
-        publish_state(index,channel,level);
-        rc=0;
+        json_object_object_get_ex(returnObj, "timeToTake", &valueObj);
+        event.time_to_take = json_object_get_int(valueObj);
+
+        rc = handle_tracker(param,&event);
     }
 
     return rc;
 }
 
+int handle_tracker(struct rako_data_t *param, struct rako_tracker_t *event)
+{
+    struct channels_t *ch = rako_find_channel(param,event->room,event->channel);
+
+   log_printf(LOG_DEBUG,"Room %d - Channel %d - Target %d\r\n",event->room,event->channel,event->target_level);
+    if ((ch != NULL) && ch->predicted) {
+        ch->predicted = 0;
+        metrics_count((ch->target_level == event->target_level) ? METRIC_SCENE_CONFIRMED : METRIC_SCENE_CORRECTED,1);
+    }
+    rako_set_level(param,event->room,event->channel,event->current_level,event->target_level);
+    rako_track_fade(param,event);
+    return 0;
+}
+
 
 //{"name":"feedback","payload":{"action":{"actUniqueId":-1,"defaultFadeRate":true,"decay":0,"expFadeRate":false,"scene":1,"command":49},"room":19,"channel":0,"description":"[Rm:19 outside lights] Scene 1"}}
 int parse_feedback(void *pvt, struct socket_client_t *sp)
 {
     int rc = -1;
-    int i;
-    char *value;
 
     struct rako_data_t *param = pvt;
+    struct rako_feedback_t event;
     json_object *returnObj;
     //json_object *itemObj;
     json_object *valueObj;
@@ -727,22 +1828,23 @@ int parse_feedback(void *pvt, struct socket_client_t *sp)
     json_object_object_get_ex(param->rx_json, "payload", &returnObj);
     if (json_object_get_type(returnObj) == json_type_object) {
         json_object_object_get_ex(returnObj, "room", &valueObj);
-        int index = json_object_get_int(valueObj);
+        event.room = json_object_get_int(valueObj);
 
         json_object_object_get_ex(returnObj, "channel", &valueObj);
-        int channel = json_object_get_int(valueObj);
+        event.channel = json_object_get_int(valueObj);
 
+        // json-c reads a missing key as 0, which is a real scene, so check they are there
         json_object_object_get_ex(returnObj, "action", &actionObj);
         if (json_object_get_type(actionObj) == json_type_object) {
-            json_object_object_get_ex(actionObj, "scene", &valueObj);
-            int scene = json_object_get_int(valueObj);
-
-            json_object_object_get_ex(actionObj, "command", &valueObj);
-            int command = json_object_get_int(valueObj);
+            event.scene = -1;
+            if (json_object_object_get_ex(actionObj, "scene", &valueObj))
+                event.scene = json_object_get_int(valueObj);
 
-           syslog(LOG_NOTICE,"Setting scene %d on Room %d\r\n",scene,index);
+            event.command = -1;
+            if (json_object_object_get_ex(actionObj, "command", &valueObj))
+                event.command = json_object_get_int(valueObj);
 
-            update_scene(index,0,scene);
+            handle_feedback(param,&event);
         }
 
         rc=0;
@@ -751,6 +1853,413 @@ int parse_feedback(void *pvt, struct socket_client_t *sp)
     return rc;
 }
 
+// Only a scene for the whole room says what every channel is doing now
+int handle_feedback(struct rako_data_t *param, struct rako_feedback_t *event)
+{
+    if ((event->command != RAKO_FEEDBACK_SCENE) || (event->channel != 0) || (event->scene < 0))
+        return 0;
+
+   log_printf(LOG_DEBUG,"Setting scene %d on Room %d\r\n",event->scene,event->room);
+
+    rako_set_scene(param,event->room,event->scene);
+    rako_predict_scene(param,event->room,event->scene);
+    return 0;
+}
+
+
+// Forget the room model and everything the mirror knew about it, the
+// arrays are kept for the rediscovery that follows
+void rako_reset_rooms(struct rako_data_t *param)
+{
+    int a;
+
+    for (a=0; a<param->room_count; a++)
+        free(param->rooms[a].channels);
+    param->room_count = 0;
+    param->channel_total = 0;
+    idmap_clear(&param->room_slots);
+    idmap_clear(&param->channel_slots);
+    param->dirty_channel_count = 0;
+    param->dirty_room_count = 0;
+}
+
+struct rooms_t *rako_find_room(struct rako_data_t *param, int room)
+{
+    int slot = idmap_get(&param->room_slots,room);
+
+    if (slot < 0)
+        return NULL;
+    return &param->rooms[slot];
+}
+
+struct channels_t *rako_find_channel(struct rako_data_t *param, int room, int channel)
+{
+    struct rooms_t *rm = rako_find_room(param,room);
+    int slot;
+
+    if (rm == NULL)
+        return NULL;
+    slot = idmap_get(&param->channel_slots,RAKO_CHANNEL_KEY(room,channel));
+    if (slot < 0)
+        return NULL;
+    return &rm->channels[slot];
+}
+
+// Hubs list rooms in id order, so the search from the end normally stops at once
+struct rooms_t *rako_add_room(struct rako_data_t *param, int room)
+{
+    struct rooms_t *rm = rako_find_room(param,room);
+    int pos,a;
+
+    if (rm != NULL)
+        return rm;
+
+    if (param->room_count == param->room_alloc) {
+        int alloc = param->room_alloc ? param->room_alloc*2 : 16;
+        struct rooms_t *rooms = realloc(param->rooms,alloc*sizeof(struct rooms_t));
+        int *dirty = realloc(param->dirty_rooms,alloc*sizeof(int));
+
+        if (rooms != NULL)
+            param->rooms = rooms;
+        if (dirty != NULL)
+            param->dirty_rooms = dirty;
+        if ((rooms == NULL) || (dirty == NULL)) {
+           log_printf(LOG_ERR,"Out of memory adding room %d\r\n",room);
+            return NULL;
+        }
+        param->room_alloc = alloc;
+    }
+
+    pos = param->room_count;
+    while ((pos > 0) && (param->rooms[pos-1].room_id > room))
+        pos--;
+    memmove(&param->rooms[pos+1],&param->rooms[pos],(param->room_count-pos)*sizeof(struct rooms_t));
+    param->room_count++;
+
+    rm = &param->rooms[pos];
+    memset(rm,0,sizeof(struct rooms_t));
+    rm->room_id = room;
+    rm->current_scene = -1;
+
+    for (a=pos; a<param->room_count; a++)
+        idmap_put(&param->room_slots,param->rooms[a].room_id,a);
+    return rm;
+}
+
+struct channels_t *rako_add_channel(struct rako_data_t *param, struct rooms_t *rm, int channel)
+{
+    struct channels_t *ch = rako_find_channel(param,rm->room_id,channel);
+    int pos,a;
+
+    if (ch != NULL)
+        return ch;
+
+    if (rm->channel_count == rm->channel_alloc) {
+        int alloc = rm->channel_alloc ? rm->channel_alloc*2 : 8;
+        struct channels_t *channels = realloc(rm->channels,alloc*sizeof(struct channels_t));
+
+        if (channels == NULL) {
+           log_printf(LOG_ERR,"Out of memory adding channel %d/%d\r\n",rm->room_id,channel);
+            return NULL;
+        }
+        rm->channels = channels;
+        rm->channel_alloc = alloc;
+    }
+
+    // Every channel can be dirty at once
+    if (param->channel_total % 64 == 0) {
+        unsigned int *dirty = realloc(param->dirty_channels,(param->channel_total+64)*sizeof(unsigned int));
+
+        if (dirty == NULL) {
+           log_printf(LOG_ERR,"Out of memory adding channel %d/%d\r\n",rm->room_id,channel);
+            return NULL;
+        }
+        param->dirty_channels = dirty;
+    }
+
+    pos = rm->channel_count;
+    while ((pos > 0) && (rm->channels[pos-1].channel_id > channel))
+        pos--;
+    memmove(&rm->channels[pos+1],&rm->channels[pos],(rm->channel_count-pos)*sizeof(struct channels_t));
+    rm->channel_count++;
+    param->channel_total++;
+
+    ch = &rm->channels[pos];
+    memset(ch,0,sizeof(struct channels_t));
+    ch->channel_id = channel;
+    ch->current_level = -1;
+    ch->target_level = -1;
+
+    for (a=pos; a<rm->channel_count; a++)
+        idmap_put(&param->channel_slots,RAKO_CHANNEL_KEY(rm->room_id,rm->channels[a].channel_id),a);
+    return ch;
+}
+
+// Mirror updates, only values that differ from what was last seen get queued
+void rako_set_level(struct rako_data_t *param, int room, int channel, int current, int target)
+{
+    struct channels_t *ch;
+
+    ch = rako_find_channel(param,room,channel);
+    if (ch == NULL)
+        return;
+
+    ch->current_level = current;
+    if (ch->target_level == target)
+        return;
+
+    ch->target_level = target;
+    if (ch->dirty == 0) {
+        ch->dirty = 1;
+        param->dirty_channels[param->dirty_channel_count++] = RAKO_CHANNEL_KEY(room,channel);
+    }
+}
+
+void rako_set_scene(struct rako_data_t *param, int room, int scene)
+{
+    struct rooms_t *rm;
+
+    rm = rako_find_room(param,room);
+    if (rm == NULL)
+        return;
+
+    if (rm->current_scene == scene)
+        return;
+
+    rm->current_scene = scene;
+    if (rm->scene_dirty == 0) {
+        rm->scene_dirty = 1;
+        param->dirty_rooms[param->dirty_room_count++] = room;
+    }
+}
+
+// Every channel of the room heads for its level in the scene table. That
+// is published straight away, the tracker events that follow confirm it
+// or, if the table was stale, correct it.
+void rako_predict_scene(struct rako_data_t *param, int room, int scene)
+{
+    struct rooms_t *rm = rako_find_room(param,room);
+    int a;
+
+    if ((rm == NULL) || (scene < 0) || (scene >= RAKO_SCENE_LEVELS))
+        return;
+
+    for (a=0; a<rm->channel_count; a++) {
+        struct channels_t *ch = &rm->channels[a];
+
+        if (ch->has_scene_levels == 0)
+            continue;
+        rako_set_level(param,room,ch->channel_id,ch->current_level,ch->scene_levels[scene]);
+        ch->predicted = 1;
+        metrics_count(METRIC_SCENE_PREDICTED,1);
+    }
+}
+
+// A tracker with a timeToTake starts a fade. Rather than leaving the end
+// to the periodic refresh, the room is read back once when it is due.
+void rako_track_fade(struct rako_data_t *param, struct rako_tracker_t *event)
+{
+    struct channels_t *ch = rako_find_channel(param,event->room,event->channel);
+    struct socket_client_t *sp = param->socket_pvt;
+
+    if (ch == NULL)
+        return;
+
+    if ((event->time_to_take <= 0) || (event->current_level == event->target_level)) {
+        ch->fade_due = 0;
+        return;
+    }
+
+    ch->fade_from = event->current_level;
+    ch->fade_due = socket_client_now() + event->time_to_take;
+    metrics_count(METRIC_FADE_TRACKED,1);
+
+    // Already due to fire before this one ends
+    if ((param->fade_due != 0) && (param->fade_due <= ch->fade_due))
+        return;
+    param->fade_due = ch->fade_due;
+    if (sp != NULL)
+        socket_client_timer_start(sp,RAKO_TIMER_FADE,event->time_to_take + RAKO_FADE_GRACE_MS,0,rako_fade_timer);
+}
+
+void rako_reset_fades(struct rako_data_t *param)
+{
+    int a,b;
+
+    for (a=0; a<param->room_count; a++) {
+        param->rooms[a].fade_check = 0;
+        for (b=0; b<param->rooms[a].channel_count; b++)
+            param->rooms[a].channels[b].fade_due = 0;
+    }
+    param->fade_due = 0;
+}
+
+// Runs on the MQTT thread, the socket thread picks it up on its next publish pass
+void rako_mqtt_connected(void *p)
+{
+    int a;
+
+    // Registered after the first connect, so this is a reconnect to a broker
+    // that may have been restarted without its retained configs
+    for (a=0; a<rako_hub_count; a++) {
+        __atomic_store_n(&rako_hubs[a]->rediscover,1,__ATOMIC_RELEASE);
+        __atomic_store_n(&rako_hubs[a]->republish,1,__ATOMIC_RELEASE);
+    }
+}
+
+// One hub keeps the original rako_<room>_<channel> names so existing HA
+// entities survive, with several the hub id keeps them apart
+void rako_set_prefix(struct rako_data_t *param)
+{
+    const char *id = param->hub_id[0] ? param->hub_id : param->rako_address;
+    char prefix[sizeof(param->topic_prefix)];
+    int n;
+
+    if (rako_hub_count <= 1) {
+        strcpy(param->topic_prefix,"rako");
+        return;
+    }
+
+    n = sprintf(prefix,"rako_");
+    for (; *id && (n < (int)sizeof(prefix)-1); id++) {
+        if (isalnum((unsigned char)*id))
+            prefix[n++] = tolower((unsigned char)*id);
+    }
+    prefix[n] = 0;
+
+    // Also called on every keepalive reply and after a cache load
+    if (strcmp(prefix,param->topic_prefix) == 0)
+        return;
+    strcpy(param->topic_prefix,prefix);
+    log_printf(LOG_INFO,"Hub %s publishes under %s\r\n",param->rako_address,param->topic_prefix);
+
+    // The CHANNEL answer beat the status reply, nothing has been published yet
+    if (param->publish_pending) {
+        param->publish_pending = 0;
+        rako_publish_model(param);
+        rako_discovery_sweep(param);
+        // The snapshot taken with the CHANNEL answer had no command topics
+        rako_view_publish();
+        rako_cache_save(param);
+    }
+}
+
+void rako_publish_dirty(struct rako_data_t *param)
+{
+    unsigned long long now;
+    int a,b;
+
+    rako_view_reclaim();
+
+    // Nothing has a topic yet, the mirror keeps it dirty until then
+    if (param->topic_prefix[0] == 0)
+        return;
+
+    if (__atomic_exchange_n(&param->rediscover,0,__ATOMIC_ACQ_REL)) {
+        param->config_force = 1;
+        rako_publish_model(param);
+        param->config_force = 0;
+    }
+
+    // The broker may have lost retained state, queue everything the mirror knows
+    if (__atomic_exchange_n(&param->republish,0,__ATOMIC_ACQ_REL)) {
+        for (a=0; a<param->room_count; a++) {
+            struct rooms_t *rm = &param->rooms[a];
+
+            if ((rm->current_scene >= 0) && (rm->scene_dirty == 0)) {
+                rm->scene_dirty = 1;
+                param->dirty_rooms[param->dirty_room_count++] = rm->room_id;
+            }
+            for (b=0; b<rm->channel_count; b++) {
+                struct channels_t *ch = &rm->channels[b];
+
+                if ((ch->target_level >= 0) && (ch->dirty == 0)) {
+                    ch->dirty = 1;
+                    param->dirty_channels[param->dirty_channel_count++] = RAKO_CHANNEL_KEY(rm->room_id,ch->channel_id);
+                }
+            }
+        }
+    }
+
+    if ((param->dirty_channel_count == 0) && (param->dirty_room_count == 0))
+        return;
+
+    now = socket_client_now();
+
+    for (a=0; a<param->dirty_room_count; a++) {
+        struct rooms_t *rm = rako_find_room(param,param->dirty_rooms[a]);
+
+        if (rm == NULL)
+            continue;
+        update_scene(param,rm->room_id,0,rm->current_scene);
+        rm->scene_dirty = 0;
+        rm->scene_published = now;
+    }
+    param->dirty_room_count = 0;
+
+    for (a=0; a<param->dirty_channel_count; a++) {
+        int room = param->dirty_channels[a] >> 16;
+        int channel = param->dirty_channels[a] & 0xffff;
+        struct channels_t *ch = rako_find_channel(param,room,channel);
+
+        if (ch == NULL)
+            continue;
+        publish_state(param,room,channel,ch->target_level,
+                      (param->transitions && (ch->fade_due > now)) ? (int)(ch->fade_due - now) : 0);
+        ch->dirty = 0;
+        ch->last_published = now;
+    }
+    param->dirty_channel_count = 0;
+}
+
+
+// Fast path for the two event types the hub sends in bursts. Only frames with
+// exactly the expected integer fields are taken, everything else returns -1
+// and goes through json-c and the parse_* functions above.
+int rako_span_callback(void *pvt, const char *span, int len)
+{
+    struct rako_data_t *param = pvt;
+    unsigned long long start = metrics_now_us();
+
+    if (fastjson_is_plain(span,len) < 0)
+        return -1;
+
+    if (fastjson_string_equals(span,len,"name","tracker") == 0) {
+        struct rako_tracker_t event;
+
+        if ((fastjson_get_int(span,len,"roomId",&event.room) < 0) ||
+            (fastjson_get_int(span,len,"channelId",&event.channel) < 0) ||
+            (fastjson_get_int(span,len,"currentLevel",&event.current_level) < 0) ||
+            (fastjson_get_int(span,len,"targetLevel",&event.target_level) < 0) ||
+            (fastjson_get_int(span,len,"timeToTake",&event.time_to_take) < 0))
+            return -1;
+
+        handle_tracker(param,&event);
+        metrics_count(METRIC_HUB_FRAMES_FAST,1);
+        metrics_observe_since(METRIC_PARSE_TRACKER,start);
+        return 0;
+    }
+
+    if (fastjson_string_equals(span,len,"name","feedback") == 0) {
+        struct rako_feedback_t event;
+
+        if ((fastjson_get_int(span,len,"room",&event.room) < 0) ||
+            (fastjson_get_int(span,len,"channel",&event.channel) < 0) ||
+            (fastjson_get_int(span,len,"command",&event.command) < 0))
+            return -1;
+        // Only scene commands carry one, handle_feedback ignores the rest
+        if (fastjson_get_int(span,len,"scene",&event.scene) < 0)
+            event.scene = -1;
+
+        handle_feedback(param,&event);
+        metrics_count(METRIC_HUB_FRAMES_FAST,1);
+        metrics_observe_since(METRIC_PARSE_FEEDBACK,start);
+        return 0;
+    }
+
+    return -1;
+}
+
 
 
 
@@ -762,39 +2271,428 @@ room_number, Fiendly name, unique
 homeassistant/light/kitchen/config
 #endif
 
-void publish_discovery(int roomid,int channel_id,char *name, char *unique_name)
+void publish_discovery(struct rako_data_t *param,int roomid,int channel_id,char *name, char *unique_name)
 {
 
     char discover[512];
     char tag[512];
+    const char *prefix = param->topic_prefix;
+
+    // No topic yet, rako_set_prefix publishes the model once there is
+    if (prefix[0] == 0)
+        return;
 
-    sprintf(tag,"homeassistant/light/rako_%d_%d/config",roomid,channel_id);
+    sprintf(tag,"homeassistant/light/%s_%d_%d",prefix,roomid,channel_id);
+    rako_register_command(param,tag,roomid,channel_id,0);
 
-    sprintf(discover,"{\"~\": \"homeassistant/light/rako_%d_%d\",\"name\": \"%s_ch%d\",\"unique_id\":\"rako_%d_%d\",\"cmd_t\":\"~/set\",\"stat_t\":\"~/state\",\"schema\":\"json\",\"brightness\":true}\0",
-            roomid,channel_id,name,channel_id,roomid,channel_id);
+    sprintf(tag,"homeassistant/light/%s_%d_%d/config",prefix,roomid,channel_id);
 
-    mqtt_writedata(tag,discover);
+    sprintf(discover,"{\"~\": \"homeassistant/light/%s_%d_%d\",\"name\": \"%s_ch%d\",\"unique_id\":\"%s_%d_%d\",\"cmd_t\":\"~/set\",\"stat_t\":\"~/state\",\"schema\":\"json\",\"brightness\":true}\0",
+            prefix,roomid,channel_id,name,channel_id,prefix,roomid,channel_id);
+
+    rako_publish_config(param,tag,discover);
 
 
 }
 
-void publish_scene(int roomid,int channel_id,char *name, char *unique_name)
+void publish_scene(struct rako_data_t *param,int roomid,int channel_id,char *name, char *unique_name)
 {
 
     char discover[512];
     char tag[512];
     int  scene;
+    const char *prefix = param->topic_prefix;
+
+    if (prefix[0] == 0)
+        return;
+
+    for (scene=0; scene<RAKO_SCENES; scene++) {
+        sprintf(tag,"homeassistant/light/%s_%d_%d_%d",prefix,roomid,channel_id,scene);
+        rako_register_command(param,tag,roomid,channel_id,scene);
+
+        sprintf(tag,"homeassistant/light/%s_%d_%d_%d/config",prefix,roomid,channel_id,scene);
+        sprintf(discover,"{\"~\": \"homeassistant/light/%s_%d_%d_%d\",\"name\": \"%s_scene_%d\",\"unique_id\":\"%s_%d_%d_%d\",\"cmd_t\":\"~/set\",\"stat_t\":\"~/state\",\"schema\":\"json\",\"brightness\":false}\0",
+                prefix,roomid,channel_id,scene,name,scene,prefix,roomid,channel_id,scene);
+        rako_publish_config(param,tag,discover);
+    }
+
+}
+
+// One light for every channel of a room, sent to the hub as channel 0. For
+// room 0 that is the whole house.
+void publish_room(struct rako_data_t *param,int roomid,char *name)
+{
+    char discover[512];
+    char tag[512];
+    struct rooms_t *rm = rako_find_room(param,roomid);
+    const char *prefix = param->topic_prefix;
+
+    if ((prefix[0] == 0) || (rm == NULL) || ((roomid != 0) && (rm->channel_count == 0)))
+        return;
+
+    sprintf(tag,"homeassistant/light/%s_%d_0",prefix,roomid);
+    rako_register_command(param,tag,roomid,0,-1);
+
+    sprintf(tag,"homeassistant/light/%s_%d_0/config",prefix,roomid);
+    sprintf(discover,"{\"~\": \"homeassistant/light/%s_%d_0\",\"name\": \"%s%s\",\"unique_id\":\"%s_%d_0\",\"cmd_t\":\"~/set\",\"stat_t\":\"~/state\",\"schema\":\"json\",\"brightness\":true}",
+            prefix,roomid,name,(roomid == 0) ? "" : "_all",prefix,roomid);
+    rako_publish_config(param,tag,discover);
+}
+
+// Publishes a discovery config unless the same payload already went out on
+// this topic, possibly in an earlier run when the cache was loaded. Marks
+// the topic as seen by the current discovery pass either way.
+int rako_publish_config(struct rako_data_t *param, char *topic, char *payload)
+{
+    unsigned int hash = topicmap_hash(payload,strlen(payload));
+    struct rako_discovery_t *d = topicmap_get(&param->discovery,topic);
+
+    if (d == NULL) {
+        d = calloc(1,sizeof(struct rako_discovery_t));
+        if (d == NULL)
+            return -1;
+        topicmap_insert(&param->discovery,topic,d);
+    } else if ((d->hash == hash) && ((d->payload == NULL) || (strcmp(d->payload,payload) == 0)) &&
+               (param->config_force == 0)) {
+        d->generation = param->discovery_generation;
+        metrics_count(METRIC_DISCOVERY_UNCHANGED,1);
+        return 0;
+    }
+
+    d->hash = hash;
+    d->generation = param->discovery_generation;
+    free(d->payload);
+    d->payload = strdup(payload);
+    metrics_count(METRIC_DISCOVERY_PUBLISHED,1);
+    return mqtt_publish(topic,payload);
+}
+
+// Configs the last discovery pass did not produce belong to rooms or
+// channels the hub no longer has. An empty retained payload makes HA drop
+// the entity, and its command topic is forgotten.
+void rako_discovery_sweep(struct rako_data_t *param)
+{
+    struct topicmap_entry_t *e;
+    unsigned int bucket;
+    char **stale;
+    int seen = 0, count = 0;
+    int a;
 
-    for (scene=0; scene<6; scene++) {
-        sprintf(tag,"homeassistant/light/rako_%d_%d_%d/config",roomid,channel_id,scene);
-        sprintf(discover,"{\"~\": \"homeassistant/light/rako_%d_%d_%d\",\"name\": \"%s_scene_%d\",\"unique_id\":\"rako_%d_%d_%d\",\"cmd_t\":\"~/set\",\"stat_t\":\"~/state\",\"schema\":\"json\",\"brightness\":false}\0",
-                roomid,channel_id,scene,name,scene,roomid,channel_id,scene);
-        mqtt_writedata(tag,discover);
+    TOPICMAP_FOREACH(&param->discovery,bucket,e) {
+        struct rako_discovery_t *d = e->value;
+
+        if (d->generation == param->discovery_generation)
+            seen++;
+        else
+            count++;
+    }
+
+    // An empty answer is more likely a hub hiccup than an empty house
+    if ((seen == 0) || (count == 0))
+        return;
+
+    stale = malloc(count * sizeof(char *));
+    if (stale == NULL)
+        return;
+    count = 0;
+    TOPICMAP_FOREACH(&param->discovery,bucket,e) {
+        struct rako_discovery_t *d = e->value;
+
+        if (d->generation != param->discovery_generation)
+            stale[count++] = strdup(e->topic);
+    }
+
+    for (a=0; a<count; a++) {
+        struct rako_discovery_t *d;
+        char *suffix;
+
+        if (stale[a] == NULL)
+            continue;
+        mqtt_publish(stale[a],"");
+        metrics_count(METRIC_DISCOVERY_REMOVED,1);
+       log_dump(LOG_INFO,"Removing %s\r\n",stale[a]);
+
+        d = topicmap_remove(&param->discovery,stale[a]);
+        free(d->payload);
+        free(d);
+
+        // .../config -> .../state and .../set, stale[] has room for both
+        suffix = strrchr(stale[a],'/');
+        if ((suffix != NULL) && (strcmp(suffix,"/config") == 0)) {
+            struct rako_command_t *target;
+
+            strcpy(suffix,"/state");
+            mqtt_publish(stale[a],"");
+
+            strcpy(suffix,"/set");
+            target = topicmap_remove(&rako_commands,stale[a]);
+            free(target);
+        }
+        free(stale[a]);
+    }
+    free(stale);
+}
+
+// Discovery for everything in the model, as parse_query_channel would
+void rako_publish_model(struct rako_data_t *param)
+{
+    int a,b;
+
+    for (a=0; a<param->room_count; a++) {
+        struct rooms_t *rm = &param->rooms[a];
+
+        publish_scene(param,rm->room_id,0,rm->room_name,rm->room_name);
+        for (b=0; b<rm->channel_count; b++)
+            publish_discovery(param,rm->room_id,rm->channels[b].channel_id,rm->room_name,rm->channels[b].channel_name);
+        publish_room(param,rm->room_id,rm->room_name);
+    }
+}
+
+static int rako_cache_put(char **buf, int *len, int *alloc, const void *data, int size)
+{
+    if (*len + size > *alloc) {
+        int n = *alloc ? *alloc : 4096;
+        char *p;
+
+        while (*len + size > n)
+            n *= 2;
+        p = realloc(*buf,n);
+        if (p == NULL)
+            return -1;
+        *buf = p;
+        *alloc = n;
+    }
+    memcpy(*buf + *len,data,size);
+    *len += size;
+    return 0;
+}
+
+// Writes the model and the config hashes next to the old file and renames
+// it over, so a crash leaves either the old cache or the new one
+void rako_cache_save(struct rako_data_t *param)
+{
+    struct rako_cache_header_t header;
+    struct topicmap_entry_t *e;
+    unsigned int bucket;
+    unsigned int checksum;
+    char path[sizeof(param->cache_path)+4];
+    char *buf = NULL;
+    int len = 0, alloc = 0;
+    int rc = 0;
+    int a,b;
+    FILE *f;
+
+    if (param->cache_path[0] == 0)
+        return;
+
+    memset(&header,0,sizeof(header));
+    memcpy(header.magic,RAKO_CACHE_MAGIC,4);
+    header.version = RAKO_CACHE_VERSION;
+    header.room_count = param->room_count;
+    header.config_count = param->discovery.count;
+    strcpy(header.product_type,param->product_type);
+    strcpy(header.hub_id,param->hub_id);
+    strcpy(header.hub_mac,param->hub_mac);
+    strcpy(header.hub_version,param->hub_version);
+    strcpy(header.topic_prefix,param->topic_prefix);
+    rc |= rako_cache_put(&buf,&len,&alloc,&header,sizeof(header));
+
+    for (a=0; a<param->room_count; a++) {
+        struct rooms_t *rm = &param->rooms[a];
+        struct rako_cache_room_t room;
+
+        memset(&room,0,sizeof(room));
+        room.room_id = rm->room_id;
+        room.channel_count = rm->channel_count;
+        strcpy(room.room_name,rm->room_name);
+        strcpy(room.device_type,rm->device_type);
+        rc |= rako_cache_put(&buf,&len,&alloc,&room,sizeof(room));
+
+        for (b=0; b<rm->channel_count; b++) {
+            struct rako_cache_channel_t channel;
+
+            memset(&channel,0,sizeof(channel));
+            channel.channel_id = rm->channels[b].channel_id;
+            strcpy(channel.channel_name,rm->channels[b].channel_name);
+            strcpy(channel.channel_type,rm->channels[b].channel_type);
+            memcpy(channel.scene_levels,rm->channels[b].scene_levels,RAKO_SCENE_LEVELS);
+            channel.has_scene_levels = rm->channels[b].has_scene_levels;
+            rc |= rako_cache_put(&buf,&len,&alloc,&channel,sizeof(channel));
+        }
+    }
+
+    TOPICMAP_FOREACH(&param->discovery,bucket,e) {
+        struct rako_discovery_t *d = e->value;
+        struct rako_cache_config_t config;
+
+        config.hash = d->hash;
+        config.topic_len = strlen(e->topic);
+        rc |= rako_cache_put(&buf,&len,&alloc,&config,sizeof(config));
+        rc |= rako_cache_put(&buf,&len,&alloc,e->topic,config.topic_len);
+    }
+
+    if (rc < 0) {
+       log_printf(LOG_ERR,"Out of memory saving the discovery cache\r\n");
+        free(buf);
+        return;
+    }
+
+    checksum = topicmap_hash(buf,len);
+    if (checksum == param->cache_checksum) {
+        free(buf);
+        return;
+    }
+
+    sprintf(path,"%s.new",param->cache_path);
+    f = fopen(path,"wb");
+    if (f == NULL) {
+       log_printf(LOG_WARNING,"Could not write %s: %s\r\n",path,strerror(errno));
+        free(buf);
+        return;
+    }
+    if ((fwrite(buf,1,len,f) != (size_t)len) || (fwrite(&checksum,1,sizeof(checksum),f) != sizeof(checksum)) ||
+        (fflush(f) != 0) || (fsync(fileno(f)) < 0)) {
+       log_printf(LOG_WARNING,"Could not write %s: %s\r\n",path,strerror(errno));
+        fclose(f);
+        unlink(path);
+        free(buf);
+        return;
+    }
+    fclose(f);
+    free(buf);
+
+    if (rename(path,param->cache_path) < 0) {
+       log_printf(LOG_WARNING,"Could not replace %s: %s\r\n",param->cache_path,strerror(errno));
+        unlink(path);
+        return;
+    }
+    param->cache_checksum = checksum;
+   log_printf(LOG_INFO,"Saved %d rooms and %d configs to %s\r\n",param->room_count,(int)param->discovery.count,param->cache_path);
+}
+
+// Fills the model and the config hashes from the cache. Anything short,
+// from another version or failing the checksum leaves the model empty.
+int rako_cache_load(struct rako_data_t *param)
+{
+    struct rako_cache_header_t header;
+    unsigned int checksum;
+    char *buf, *p, *end;
+    long size;
+    unsigned int a;
+    int b;
+    FILE *f;
+
+    if (param->cache_path[0] == 0)
+        return -1;
+
+    f = fopen(param->cache_path,"rb");
+    if (f == NULL)
+        return -1;
+    fseek(f,0,SEEK_END);
+    size = ftell(f);
+    rewind(f);
+
+    if ((size < (long)(sizeof(header)+sizeof(checksum))) || ((buf = malloc(size)) == NULL)) {
+        fclose(f);
+        return -1;
+    }
+    if (fread(buf,1,size,f) != (size_t)size) {
+        fclose(f);
+        free(buf);
+        return -1;
+    }
+    fclose(f);
+
+    end = buf + size - sizeof(checksum);
+    memcpy(&checksum,end,sizeof(checksum));
+    memcpy(&header,buf,sizeof(header));
+    if ((memcmp(header.magic,RAKO_CACHE_MAGIC,4) != 0) || (header.version != RAKO_CACHE_VERSION) ||
+        (topicmap_hash(buf,end-buf) != checksum)) {
+       log_printf(LOG_WARNING,"Ignoring discovery cache %s\r\n",param->cache_path);
+        free(buf);
+        return -1;
     }
+    p = buf + sizeof(header);
+
+    rako_reset_rooms(param);
+    for (a=0; a<header.room_count; a++) {
+        struct rako_cache_room_t room;
+        struct rooms_t *rm;
+
+        if (end - p < (long)sizeof(room))
+            goto corrupt;
+        memcpy(&room,p,sizeof(room));
+        p += sizeof(room);
+        if ((room.channel_count < 0) || (end - p < (long)(room.channel_count*sizeof(struct rako_cache_channel_t))))
+            goto corrupt;
+
+        rm = rako_add_room(param,room.room_id);
+        if (rm == NULL)
+            goto corrupt;
+        memcpy(rm->room_name,room.room_name,sizeof(rm->room_name)-1);
+        memcpy(rm->device_type,room.device_type,sizeof(rm->device_type)-1);
+
+        for (b=0; b<room.channel_count; b++) {
+            struct rako_cache_channel_t channel;
+            struct channels_t *ch;
+
+            memcpy(&channel,p,sizeof(channel));
+            p += sizeof(channel);
+            ch = rako_add_channel(param,rm,channel.channel_id);
+            if (ch == NULL)
+                goto corrupt;
+            memcpy(ch->channel_name,channel.channel_name,sizeof(ch->channel_name)-1);
+            memcpy(ch->channel_type,channel.channel_type,sizeof(ch->channel_type)-1);
+            memcpy(ch->scene_levels,channel.scene_levels,RAKO_SCENE_LEVELS);
+            ch->has_scene_levels = channel.has_scene_levels;
+        }
+    }
+
+    for (a=0; a<header.config_count; a++) {
+        struct rako_cache_config_t config;
+        struct rako_discovery_t *d;
+        char topic[512];
+
+        if (end - p < (long)sizeof(config))
+            goto corrupt;
+        memcpy(&config,p,sizeof(config));
+        p += sizeof(config);
+        if ((config.topic_len >= sizeof(topic)) || (end - p < (long)config.topic_len))
+            goto corrupt;
+        memcpy(topic,p,config.topic_len);
+        topic[config.topic_len] = 0;
+        p += config.topic_len;
+
+        d = topicmap_get(&param->discovery,topic);
+        if (d == NULL) {
+            d = calloc(1,sizeof(struct rako_discovery_t));
+            if (d == NULL)
+                goto corrupt;
+            topicmap_insert(&param->discovery,topic,d);
+        }
+        d->hash = config.hash;
+    }
+
+    memcpy(param->product_type,header.product_type,sizeof(param->product_type)-1);
+    memcpy(param->hub_id,header.hub_id,sizeof(param->hub_id)-1);
+    memcpy(param->hub_mac,header.hub_mac,sizeof(param->hub_mac)-1);
+    memcpy(param->hub_version,header.hub_version,sizeof(param->hub_version)-1);
+    // Several hubs are named after the id the cached status gave
+    rako_set_prefix(param);
+
+    param->cache_checksum = checksum;
+    free(buf);
+   log_printf(LOG_NOTICE,"Loaded %d rooms and %d configs from %s\r\n",param->room_count,header.config_count,param->cache_path);
+    return 0;
 
+corrupt:
+   log_printf(LOG_WARNING,"Discovery cache %s is damaged, ignoring it\r\n",param->cache_path);
+    rako_reset_rooms(param);
+    free(buf);
+    return -1;
 }
 
-void update_scene(int roomid,int channel_id,int scene)
+void update_scene(struct rako_data_t *param,int roomid,int channel_id,int scene)
 {
 
     char discover[512];
@@ -802,8 +2700,8 @@ void update_scene(int roomid,int channel_id,int scene)
     int a;
 
 
-    for (a=0; a<6; a++) {
-        sprintf(tag,"homeassistant/light/rako_%d_%d_%d/state",roomid,channel_id,a);
+    for (a=0; a<RAKO_SCENES; a++) {
+        sprintf(tag,"homeassistant/light/%s_%d_%d_%d/state",param->topic_prefix,roomid,channel_id,a);
 
         char onoff[5];
         if (scene != a) {
@@ -814,20 +2712,20 @@ void update_scene(int roomid,int channel_id,int scene)
 
         sprintf(discover," { \"state\" : \"%s\" } ",onoff);
         //printf("TAG : %s [State->%s]\r\n",tag,discover);
-        mqtt_writedata(tag,discover);
+        mqtt_publish(tag,discover);
     }
 }
 
 
 
 
-void publish_state(int roomid,int channel_id,int level)
+void publish_state(struct rako_data_t *param,int roomid,int channel_id,int level,int transition_ms)
 {
 
     char discover[512];
     char tag[512];
 
-    sprintf(tag,"homeassistant/light/rako_%d_%d/state",roomid,channel_id);
+    sprintf(tag,"homeassistant/light/%s_%d_%d/state",param->topic_prefix,roomid,channel_id);
     char onoff[5];
 
     if (level ==0) {
@@ -835,8 +2733,11 @@ void publish_state(int roomid,int channel_id,int level)
     } else {
         sprintf(onoff,"ON");
     }
-    sprintf(discover,"{\"state\": \"%s\", \"brightness\": %d}",onoff,level);
-    mqtt_writedata(tag,discover);
+    if (transition_ms > 0)
+        sprintf(discover,"{\"state\": \"%s\", \"brightness\": %d, \"transition\": %d.%d}",onoff,level,transition_ms/1000,(transition_ms%1000)/100);
+    else
+        sprintf(discover,"{\"state\": \"%s\", \"brightness\": %d}",onoff,level);
+    mqtt_publish(tag,discover);
 }
 
 
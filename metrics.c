@@ -0,0 +1,301 @@
+#include "metrics.h"
+#include "log.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+
+struct metrics_histogram_t {
+    unsigned long buckets[METRIC_BUCKETS];
+    unsigned long long sum;
+    unsigned long count;
+};
+
+// Written only by the owning thread, read by the exporter with relaxed loads
+struct metrics_block_t {
+    unsigned long counters[METRIC_COUNTERS];
+    struct metrics_histogram_t histograms[METRIC_HISTOGRAMS];
+    struct metrics_block_t *next;
+};
+
+static struct metrics_block_t *metrics_blocks;
+static __thread struct metrics_block_t *metrics_local;
+static long metrics_gauges[METRIC_GAUGES];
+
+static const char *counter_names[METRIC_COUNTERS] = {
+    "rako_hub_rx_bytes_total",
+    "rako_hub_tx_bytes_total",
+    "rako_hub_frames_total{path=\"fast\"}",
+    "rako_hub_frames_total{path=\"json\"}",
+    "rako_hub_connects_total",
+    "rako_hub_disconnects_total",
+    "rako_hub_connect_failures_total",
+    "rako_mqtt_messages_total",
+    "rako_mqtt_disconnects_total",
+    "rako_publish_total{result=\"queued\"}",
+    "rako_publish_total{result=\"coalesced\"}",
+    "rako_publish_total{result=\"unchanged\"}",
+    "rako_publish_total{result=\"sent\"}",
+    "rako_publish_total{result=\"acked\"}",
+    "rako_publish_total{result=\"failed\"}",
+    "rako_commands_total{result=\"queued\"}",
+    "rako_commands_total{result=\"merged\"}",
+    "rako_commands_total{result=\"dropped\"}",
+    "rako_commands_total{result=\"sent\"}",
+    "rako_commands_total{result=\"folded\"}",
+    "rako_hub_tx_throttled_total",
+    "rako_queries_deferred_total",
+    "rako_discovery_total{result=\"published\"}",
+    "rako_discovery_total{result=\"unchanged\"}",
+    "rako_discovery_total{result=\"removed\"}",
+    "rako_scene_predictions_total{result=\"published\"}",
+    "rako_scene_predictions_total{result=\"confirmed\"}",
+    "rako_scene_predictions_total{result=\"corrected\"}",
+    "rako_fades_total",
+    "rako_fade_queries_total",
+};
+
+static const char *gauge_names[METRIC_GAUGES] = {
+    "rako_command_queue_depth",
+    "rako_publish_inflight",
+};
+
+// Name and label for each histogram
+static const char *histogram_names[METRIC_HISTOGRAMS][2] = {
+    { "rako_parse_seconds", "type=\"status\"" },
+    { "rako_parse_seconds", "type=\"query_ROOM\"" },
+    { "rako_parse_seconds", "type=\"query_CHANNEL\"" },
+    { "rako_parse_seconds", "type=\"query_LEVEL\"" },
+    { "rako_parse_seconds", "type=\"tracker\"" },
+    { "rako_parse_seconds", "type=\"feedback\"" },
+    { "rako_parse_seconds", "type=\"other\"" },
+    { "rako_hub_chunk_seconds", NULL },
+    { "rako_mqtt_dispatch_seconds", NULL },
+    { "rako_hub_discovery_seconds", NULL },
+};
+
+// First use on a thread allocates its block and pushes it on the list
+static struct metrics_block_t *metrics_block(void)
+{
+    struct metrics_block_t *b = metrics_local;
+
+    if (b != NULL)
+        return b;
+
+    b = calloc(1,sizeof(struct metrics_block_t));
+    b->next = __atomic_load_n(&metrics_blocks,__ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&metrics_blocks,&b->next,b,1,__ATOMIC_RELEASE,__ATOMIC_RELAXED))
+        ;
+    metrics_local = b;
+    return b;
+}
+
+unsigned long long metrics_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Single writer per block, so a relaxed load and store is enough
+void metrics_count(int id, unsigned long n)
+{
+    struct metrics_block_t *b = metrics_block();
+
+    __atomic_store_n(&b->counters[id],b->counters[id] + n,__ATOMIC_RELAXED);
+}
+
+void metrics_gauge(int id, long value)
+{
+    __atomic_store_n(&metrics_gauges[id],value,__ATOMIC_RELAXED);
+}
+
+// For gauges that several owners contribute to, each reports its own changes
+void metrics_gauge_add(int id, long delta)
+{
+    __atomic_add_fetch(&metrics_gauges[id],delta,__ATOMIC_RELAXED);
+}
+
+void metrics_observe(int id, unsigned long long usec)
+{
+    struct metrics_histogram_t *h = &metrics_block()->histograms[id];
+    int bucket = (usec <= 1) ? 0 : 64 - __builtin_clzll(usec - 1);
+
+    if (bucket >= METRIC_BUCKETS)
+        bucket = METRIC_BUCKETS - 1;
+
+    __atomic_store_n(&h->buckets[bucket],h->buckets[bucket] + 1,__ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum,h->sum + usec,__ATOMIC_RELAXED);
+    __atomic_store_n(&h->count,h->count + 1,__ATOMIC_RELAXED);
+}
+
+void metrics_observe_since(int id, unsigned long long start_us)
+{
+    metrics_observe(id,metrics_now_us() - start_us);
+}
+
+
+struct metrics_text_t {
+    char *data;
+    int len;
+    int size;
+};
+
+static void metrics_printf(struct metrics_text_t *t, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    while (1) {
+        va_start(ap,fmt);
+        n = vsnprintf(t->data + t->len,t->size - t->len,fmt,ap);
+        va_end(ap);
+        if (n < t->size - t->len)
+            break;
+        t->size = (t->size + n) * 2;
+        t->data = realloc(t->data,t->size);
+    }
+    t->len += n;
+}
+
+// Renders everything in the Prometheus text format, *out must be freed
+int metrics_format(char **out)
+{
+    struct metrics_text_t t = { NULL, 0, 0 };
+    struct metrics_histogram_t h;
+    struct metrics_block_t *b;
+    unsigned long value;
+    int a, c;
+
+    for (a = 0; a < METRIC_COUNTERS; a++) {
+        int base = strcspn(counter_names[a],"{");
+
+        // Labelled series of one family share a single TYPE line
+        if ((a == 0) || ((int)strcspn(counter_names[a-1],"{") != base) || (strncmp(counter_names[a],counter_names[a-1],base) != 0))
+            metrics_printf(&t,"# TYPE %.*s counter\n",base,counter_names[a]);
+
+        value = 0;
+        for (b = __atomic_load_n(&metrics_blocks,__ATOMIC_ACQUIRE); b != NULL; b = b->next)
+            value += __atomic_load_n(&b->counters[a],__ATOMIC_RELAXED);
+        metrics_printf(&t,"%s %lu\n",counter_names[a],value);
+    }
+
+    for (a = 0; a < METRIC_GAUGES; a++) {
+        metrics_printf(&t,"# TYPE %s gauge\n%s %ld\n",gauge_names[a],gauge_names[a],
+                       __atomic_load_n(&metrics_gauges[a],__ATOMIC_RELAXED));
+    }
+
+    for (a = 0; a < METRIC_HISTOGRAMS; a++) {
+        const char *name = histogram_names[a][0];
+        const char *label = histogram_names[a][1];
+        unsigned long cumulative = 0;
+
+        if ((a == 0) || (strcmp(name,histogram_names[a-1][0]) != 0))
+            metrics_printf(&t,"# TYPE %s histogram\n",name);
+
+        memset(&h,0,sizeof(h));
+        for (b = __atomic_load_n(&metrics_blocks,__ATOMIC_ACQUIRE); b != NULL; b = b->next) {
+            for (c = 0; c < METRIC_BUCKETS; c++)
+                h.buckets[c] += __atomic_load_n(&b->histograms[a].buckets[c],__ATOMIC_RELAXED);
+            h.sum += __atomic_load_n(&b->histograms[a].sum,__ATOMIC_RELAXED);
+            h.count += __atomic_load_n(&b->histograms[a].count,__ATOMIC_RELAXED);
+        }
+
+        for (c = 0; c < METRIC_BUCKETS; c++) {
+            cumulative += h.buckets[c];
+            if (c < METRIC_BUCKETS - 1)
+                metrics_printf(&t,"%s_bucket{%s%sle=\"%g\"} %lu\n",name,label ? label : "",label ? "," : "",
+                               (double)(1ULL << c) / 1000000.0,cumulative);
+            else
+                metrics_printf(&t,"%s_bucket{%s%sle=\"+Inf\"} %lu\n",name,label ? label : "",label ? "," : "",cumulative);
+        }
+        metrics_printf(&t,"%s_sum%s%s%s %g\n",name,label ? "{" : "",label ? label : "",label ? "}" : "",h.sum / 1000000.0);
+        metrics_printf(&t,"%s_count%s%s%s %lu\n",name,label ? "{" : "",label ? label : "",label ? "}" : "",h.count);
+    }
+
+    *out = t.data;
+    return t.len;
+}
+
+
+// Answers every request on the port with the current metrics, whatever the path
+static void *metrics_http_thread(void *paramPtr)
+{
+    int listen_fd = (int)(long)paramPtr;
+
+    while (1) {
+        char request[1024];
+        char header[160];
+        char *body;
+        int fd, len;
+
+        fd = accept(listen_fd,NULL,NULL);
+        if (fd < 0)
+            continue;
+
+        // One thread serves every scrape, a client that never sends must not stall it
+        struct timeval timeout = { .tv_sec = METRICS_RECV_TIMEOUT_S, .tv_usec = 0 };
+        setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof(timeout));
+        setsockopt(fd,SOL_SOCKET,SO_SNDTIMEO,&timeout,sizeof(timeout));
+
+        if (recv(fd,request,sizeof(request),0) > 0) {
+            len = metrics_format(&body);
+            snprintf(header,sizeof(header),"HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                     "Content-Length: %d\r\nConnection: close\r\n\r\n",len);
+            if ((send(fd,header,strlen(header),MSG_NOSIGNAL) > 0) && (len > 0))
+                send(fd,body,len,MSG_NOSIGNAL);
+            free(body);
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+// address is dotted quad, NULL or empty listens on loopback only
+int metrics_start(const char *address, int port)
+{
+    struct sockaddr_in addr;
+    pthread_t thread;
+    int one = 1;
+    int fd;
+
+    fd = socket(AF_INET,SOCK_STREAM,0);
+    if (fd < 0)
+        return -1;
+    setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+
+    memset(&addr,0,sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if ((address != NULL) && (address[0] != 0) && (inet_pton(AF_INET,address,&addr.sin_addr) != 1)) {
+        log_printf(LOG_ERR,"Metrics: %s is not an IPv4 address\r\n",address);
+        close(fd);
+        return -1;
+    }
+
+    if ((bind(fd,(struct sockaddr *)&addr,sizeof(addr)) < 0) || (listen(fd,4) < 0)) {
+        log_printf(LOG_ERR,"Metrics: could not listen on port %d\r\n",port);
+        close(fd);
+        return -1;
+    }
+
+    if (pthread_create(&thread,NULL,metrics_http_thread,(void *)(long)fd) != 0) {
+        close(fd);
+        return -1;
+    }
+    pthread_detach(thread);
+    char shown[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET,&addr.sin_addr,shown,sizeof(shown));
+    log_printf(LOG_NOTICE,"Metrics on http://%s:%d/metrics\r\n",shown,port);
+    return 0;
+}
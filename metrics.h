@@ -0,0 +1,78 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+// Counters, gauges and latency histograms for the hot paths. Every thread
+// updates its own block, so recording never takes a lock or bounces a cache
+// line; the exporter sums the blocks when it is scraped.
+
+enum metric_counter_t {
+    METRIC_HUB_RX_BYTES,
+    METRIC_HUB_TX_BYTES,
+    METRIC_HUB_FRAMES_FAST,         // Decoded in place by rako_span_callback
+    METRIC_HUB_FRAMES_JSON,         // Went through json-c
+    METRIC_HUB_CONNECTS,
+    METRIC_HUB_DISCONNECTS,
+    METRIC_HUB_CONNECT_FAILURES,    // Refused, timed out or unreachable attempts
+    METRIC_MQTT_RX,
+    METRIC_MQTT_DISCONNECTS,
+    METRIC_PUBLISH_QUEUED,
+    METRIC_PUBLISH_COALESCED,       // Replaced a payload still waiting
+    METRIC_PUBLISH_UNCHANGED,       // Same as what the broker already holds
+    METRIC_PUBLISH_SENT,
+    METRIC_PUBLISH_ACKED,
+    METRIC_PUBLISH_FAILED,
+    METRIC_COMMANDS_QUEUED,
+    METRIC_COMMANDS_MERGED,
+    METRIC_COMMANDS_DROPPED,
+    METRIC_COMMANDS_SENT,
+    METRIC_COMMANDS_FOLDED,         // Covered by one room or house command instead
+    METRIC_TX_THROTTLED,            // A frame waited for the hub token bucket
+    METRIC_QUERIES_DEFERRED,        // A query waited for queued commands
+    METRIC_DISCOVERY_PUBLISHED,
+    METRIC_DISCOVERY_UNCHANGED,     // Config hash matched, nothing sent
+    METRIC_DISCOVERY_REMOVED,       // Empty retained config for a vanished entity
+    METRIC_SCENE_PREDICTED,         // Channel level published from sceneLevels
+    METRIC_SCENE_CONFIRMED,         // Next tracker agreed with the prediction
+    METRIC_SCENE_CORRECTED,         // Next tracker disagreed
+    METRIC_FADE_TRACKED,            // Tracker with a timeToTake, a check is due at its end
+    METRIC_FADE_QUERIES,            // LEVEL queries sent when fades ended
+    METRIC_COUNTERS
+};
+
+enum metric_gauge_t {
+    METRIC_COMMAND_QUEUE_DEPTH,     // Summed over the hubs
+    METRIC_PUBLISH_INFLIGHT,
+    METRIC_GAUGES
+};
+
+enum metric_histogram_t {
+    METRIC_PARSE_STATUS,
+    METRIC_PARSE_QUERY_ROOM,
+    METRIC_PARSE_QUERY_CHANNEL,
+    METRIC_PARSE_QUERY_LEVEL,
+    METRIC_PARSE_TRACKER,
+    METRIC_PARSE_FEEDBACK,
+    METRIC_PARSE_OTHER,
+    METRIC_HUB_CHUNK,               // One read from the hub, framing included
+    METRIC_MQTT_DISPATCH,           // messageArrived to the end of the callback
+    METRIC_HUB_DISCOVERY,           // Discovery asked to its last answer parsed
+    METRIC_HISTOGRAMS
+};
+
+// A scrape that has not sent its request or taken the reply by then is dropped
+#define METRICS_RECV_TIMEOUT_S 2
+
+// Bucket n counts samples of at most 2^n microseconds, the last one is +Inf
+#define METRIC_BUCKETS 24
+
+unsigned long long metrics_now_us(void);
+void metrics_count(int id, unsigned long n);
+void metrics_gauge(int id, long value);
+void metrics_gauge_add(int id, long delta);
+void metrics_observe(int id, unsigned long long usec);
+void metrics_observe_since(int id, unsigned long long start_us);
+
+int metrics_format(char **out);
+int metrics_start(const char *address, int port);
+
+#endif
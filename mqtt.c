@@ -1,11 +1,43 @@
 
 #include <sys/time.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdlib.h>
-#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "mqtt.h"
 #include "list.h"
+#include "topicmap.h"
+#include "metrics.h"
+#include "log.h"
+
+mqtt_callback_ll *mqtt_funcs;
+MQTTAsync client;
+
+// Subscription filters, registration writes while the Paho thread reads
+static mqtt_topic_node mqtt_topic_root;
+static pthread_rwlock_t mqtt_topic_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Publish pipeline, everything below is guarded by mqtt_publish_lock
+static struct topicmap_t mqtt_publish_cache;     // topic -> mqtt_publish_t
+static mqtt_publish_t *mqtt_pending;             // Ordered by due
+static int mqtt_inflight;
+static int mqtt_coalesce_ms = MQTT_COALESCE_MS;
+static pthread_mutex_t mqtt_publish_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mqtt_publish_cond;
+
+void *mqtt_publish_thread(void *paramPtr);
+static int mqtt_send(char* tag, char* message, mqtt_publish_t *pub);
+
+// Told about every successful (re)connect to the broker
+static void (*mqtt_connect_func)(void *);
+static void *mqtt_connect_ptr;
+
+// Set once the first connect has completed, see mqtt_wait_connected()
+static pthread_mutex_t mqtt_ready_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mqtt_ready_cond;
+static int mqtt_ready;
 
 void connlost(void* context, char* cause);
 int messageArrived(void *context, char *topicName, int topicLen, MQTTAsync_message *message);
@@ -14,9 +46,138 @@ void onSubscribeFailure(void* context, MQTTAsync_failureData* response);
 
 void mqtt_initfuncs(void)
 {
+   pthread_t publish_thread;
+   pthread_attr_t attributes;
+   pthread_condattr_t condattr;
    
-   syslog (LOG_NOTICE, "RAKO_MQTT Init %d", getuid ());
+   log_printf(LOG_INFO, "RAKO_MQTT Init %d", getuid ());
    mqtt_funcs = 0;
+   memset(&mqtt_topic_root,0,sizeof(mqtt_topic_root));
+
+   topicmap_init(&mqtt_publish_cache,1024);
+   mqtt_pending = NULL;
+   mqtt_inflight = 0;
+
+   pthread_condattr_init(&condattr);
+   pthread_condattr_setclock(&condattr,CLOCK_MONOTONIC);
+   pthread_cond_init(&mqtt_publish_cond,&condattr);
+   pthread_cond_init(&mqtt_ready_cond,&condattr);
+
+   pthread_attr_init(&attributes);
+   pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+   pthread_create(&publish_thread, &attributes, mqtt_publish_thread, NULL);
+}
+
+// Window in which repeated publishes to one topic collapse into the last one, 0 sends at once
+void mqtt_set_coalesce(int ms)
+{
+    pthread_mutex_lock(&mqtt_publish_lock);
+    mqtt_coalesce_ms = ms < 0 ? 0 : ms;
+    pthread_mutex_unlock(&mqtt_publish_lock);
+}
+
+static unsigned long long mqtt_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+// Length of the topic level starting at topic, up to the next '/' or the end
+static int mqtt_level_len(const char *topic, int len)
+{
+    const char *slash = memchr(topic,'/',len);
+
+    if (slash == NULL)
+        return len;
+    return slash - topic;
+}
+
+static mqtt_topic_node *mqtt_topic_child(mqtt_topic_node *parent, const char *level, int len)
+{
+    mqtt_topic_node *tmp;
+
+    if ((len == 1) && (level[0] == '+'))
+        return parent->plus;
+    if ((len == 1) && (level[0] == '#'))
+        return parent->hash;
+
+    DL_FOREACH(parent->children,tmp) {
+        if ((strncmp(tmp->level,level,len) == 0) && (tmp->level[len] == 0))
+            return tmp;
+    }
+    return NULL;
+}
+
+// Walks the filter level by level, creating nodes as needed
+static void mqtt_topic_insert(const char *filter, mqtt_callback_ll *handler)
+{
+    mqtt_topic_node *node = &mqtt_topic_root;
+    int len = strlen(filter);
+    int pos = 0;
+
+    while (pos <= len) {
+        int l = mqtt_level_len(filter+pos,len-pos);
+        mqtt_topic_node *child = mqtt_topic_child(node,filter+pos,l);
+
+        if (child == NULL) {
+            child = calloc(1,sizeof(mqtt_topic_node));
+            if (l >= (int)sizeof(child->level))
+                l = sizeof(child->level)-1;
+            memcpy(child->level,filter+pos,l);
+
+            if ((l == 1) && (child->level[0] == '+'))
+                node->plus = child;
+            else if ((l == 1) && (child->level[0] == '#'))
+                node->hash = child;
+            else
+                DL_APPEND(node->children,child);
+        }
+        node = child;
+        pos += l+1;
+    }
+
+    LL_APPEND2(node->handlers,handler,node_next);
+}
+
+static void mqtt_topic_call(mqtt_topic_node *node, char *topicName, MQTTAsync_message *message)
+{
+    mqtt_callback_ll *elt;
+
+    LL_FOREACH2(node->handlers,elt,node_next) {
+        elt->functionPtr(topicName,message->payload,message->payloadlen,elt->dataPtr);
+    }
+}
+
+// Cost depends on the number of levels in topic, not on how many filters exist
+static void mqtt_topic_match(mqtt_topic_node *node, const char *topic, int len, int first, char *topicName, MQTTAsync_message *message)
+{
+    mqtt_topic_node *child;
+    int l;
+
+    // '#' also matches the parent level itself, "a/#" receives "a"
+    if ((node->hash != NULL) && !(first && (topic[0] == '$')))
+        mqtt_topic_call(node->hash,topicName,message);
+
+    if (len < 0) {
+        mqtt_topic_call(node,topicName,message);
+        return;
+    }
+
+    l = mqtt_level_len(topic,len);
+
+    DL_FOREACH(node->children,child) {
+        if ((strncmp(child->level,topic,l) == 0) && (child->level[l] == 0)) {
+            mqtt_topic_match(child,topic+l+1,len-l-1,0,topicName,message);
+            break;
+        }
+    }
+
+    // Wildcards never match topics starting with '$' at the first level
+    if ((node->plus != NULL) && !(first && (topic[0] == '$')))
+        mqtt_topic_match(node->plus,topic+l+1,len-l-1,0,topicName,message);
 }
 
 
@@ -33,7 +194,7 @@ void mqtt_subscribe(char *tag,void *ptr)
 
     rc = MQTTAsync_subscribe(client, tag, QOS, &ropts);
     
-    syslog(LOG_NOTICE,"Subscribing to %s (rc %d)\r\n",tag,rc);
+    log_printf(LOG_INFO,"Subscribing to %s (rc %d)\r\n",tag,rc);
         
 }
 
@@ -50,28 +211,63 @@ void mqtt_register_callback(char *inNode,void *func, void *ptr)
     tmp->functionPtr = func;
     tmp->dataPtr= ptr;
     tmp->subscribed=0;
+    tmp->node_next=NULL;
     DL_APPEND(mqtt_funcs, tmp);
+
+    pthread_rwlock_wrlock(&mqtt_topic_lock);
+    mqtt_topic_insert(node,tmp);
+    pthread_rwlock_unlock(&mqtt_topic_lock);
     
-    syslog(LOG_NOTICE,"%s %s\n",__FUNCTION__,inNode);
+    log_printf(LOG_DEBUG,"%s %s\n",__FUNCTION__,inNode);
     
     if (MQTTAsync_isConnected(client)) {
        mqtt_subscribe(node,tmp);
-       syslog(LOG_NOTICE,"CONNECTED : Callback Registed %s\n",inNode);
+       log_printf(LOG_INFO,"CONNECTED : Callback Registed %s\n",inNode);
     }
     
     return;
 }
 
+void mqtt_register_connect(void (*func)(void *), void *ptr)
+{
+    mqtt_connect_ptr = ptr;
+    mqtt_connect_func = func;
+}
+
+// Frees a slot in the in-flight window and wakes the publish thread
+static void mqtt_publish_done(void)
+{
+    pthread_mutex_lock(&mqtt_publish_lock);
+    if (mqtt_inflight > 0)
+        mqtt_inflight--;
+    metrics_gauge(METRIC_PUBLISH_INFLIGHT,mqtt_inflight);
+    pthread_cond_signal(&mqtt_publish_cond);
+    pthread_mutex_unlock(&mqtt_publish_lock);
+}
+
+// context is the topic's mqtt_publish_t for pipeline publishes, NULL otherwise
 void onPublishFailure(void* context, MQTTAsync_failureData* response)
 {
-	syslog(LOG_NOTICE,"Publish failed, rc %d\n", response ? -1 : response->code);
-	 
+	mqtt_publish_t *pub = context;
+
+	log_printf(LOG_WARNING,"Publish failed, rc %d\n", response ? response->code : -1);
+	metrics_count(METRIC_PUBLISH_FAILED,1);
+
+	// The broker never got it, the next identical update must go out again
+	if (pub != NULL) {
+		pthread_mutex_lock(&mqtt_publish_lock);
+		free(pub->last);
+		pub->last = NULL;
+		pthread_mutex_unlock(&mqtt_publish_lock);
+	}
+	mqtt_publish_done();
 }
 
 
 void onPublish(void* context, MQTTAsync_successData* response)
 {
-	MQTTAsync client = (MQTTAsync)context;
+	metrics_count(METRIC_PUBLISH_ACKED,1);
+	mqtt_publish_done();
 }
 
 
@@ -91,25 +287,191 @@ int mqtt_writeresponse(char *intag, char *message, int transaction)
       return 0;
     }
 
-   syslog(LOG_NOTICE,"%s FAILED with code %d\n",__FUNCTION__,rc);
+   log_printf(LOG_WARNING,"%s FAILED with code %d\n",__FUNCTION__,rc);
    return -1;  
 }
 
 
 int mqtt_writedata(char* tag, char* message)
+{
+    return mqtt_send(tag,message,NULL);
+}
+
+static int mqtt_send(char* tag, char* message, mqtt_publish_t *pub)
 {
    int rc;
    
     MQTTAsync_responseOptions pub_opts = MQTTAsync_responseOptions_initializer;
     pub_opts.onSuccess = onPublish;
     pub_opts.onFailure = onPublishFailure;
+    pub_opts.context = pub;
     
+    // Count the slot first, the PUBACK can arrive before MQTTAsync_send returns
+    pthread_mutex_lock(&mqtt_publish_lock);
+    mqtt_inflight++;
+    metrics_gauge(METRIC_PUBLISH_INFLIGHT,mqtt_inflight);
+    pthread_mutex_unlock(&mqtt_publish_lock);
+
 	rc = MQTTAsync_send(client, tag, strlen(message), message,QOS,2, &pub_opts);
+
+    if (rc != MQTTASYNC_SUCCESS) {
+        pthread_mutex_lock(&mqtt_publish_lock);
+        mqtt_inflight--;
+        metrics_gauge(METRIC_PUBLISH_INFLIGHT,mqtt_inflight);
+        pthread_mutex_unlock(&mqtt_publish_lock);
+        metrics_count(METRIC_PUBLISH_FAILED,1);
+    } else {
+        metrics_count(METRIC_PUBLISH_SENT,1);
+    }
     
     return rc;
 }
 
 
+// Queue a retained publish. Payloads identical to the last one sent on the
+// topic are dropped, and updates arriving within the coalesce window replace
+// the one still waiting. Safe to call from any thread.
+int mqtt_publish(char *tag, char *message)
+{
+    mqtt_publish_t *pub;
+    struct topicmap_entry_t *entry;
+
+    pthread_mutex_lock(&mqtt_publish_lock);
+
+    pub = topicmap_get(&mqtt_publish_cache,tag);
+    if (pub == NULL) {
+        pub = calloc(1,sizeof(mqtt_publish_t));
+        entry = topicmap_insert(&mqtt_publish_cache,tag,pub);
+        pub->topic = entry->topic;
+    }
+
+    if ((pub->last != NULL) && (strcmp(pub->last,message) == 0)) {
+        // Back to what the broker already holds, forget anything in between
+        if (pub->payload != NULL) {
+            DL_DELETE(mqtt_pending,pub);
+            free(pub->payload);
+            pub->payload = NULL;
+        }
+        pthread_mutex_unlock(&mqtt_publish_lock);
+        metrics_count(METRIC_PUBLISH_UNCHANGED,1);
+        return 0;
+    }
+
+    if (pub->payload != NULL) {
+        free(pub->payload);
+        pub->payload = strdup(message);
+        pthread_mutex_unlock(&mqtt_publish_lock);
+        metrics_count(METRIC_PUBLISH_COALESCED,1);
+        return 0;
+    }
+
+    pub->payload = strdup(message);
+    pub->due = mqtt_now() + mqtt_coalesce_ms;
+    DL_APPEND(mqtt_pending,pub);
+    pthread_cond_signal(&mqtt_publish_cond);
+
+    pthread_mutex_unlock(&mqtt_publish_lock);
+    metrics_count(METRIC_PUBLISH_QUEUED,1);
+    return 0;
+}
+
+
+// Hands due messages to Paho in batches while the in-flight window has room
+void *mqtt_publish_thread(void *paramPtr)
+{
+    mqtt_publish_t *batch[MQTT_PUBLISH_BATCH];
+    char *payloads[MQTT_PUBLISH_BATCH];
+
+    pthread_mutex_lock(&mqtt_publish_lock);
+
+    while (1) {
+        unsigned long long now;
+        int count = 0;
+        int a;
+
+        if (mqtt_pending == NULL) {
+            pthread_cond_wait(&mqtt_publish_cond,&mqtt_publish_lock);
+            continue;
+        }
+
+        now = mqtt_now();
+        if (mqtt_pending->due > now) {
+            struct timespec ts;
+
+            ts.tv_sec = mqtt_pending->due / 1000;
+            ts.tv_nsec = (mqtt_pending->due % 1000) * 1000000;
+            pthread_cond_timedwait(&mqtt_publish_cond,&mqtt_publish_lock,&ts);
+            continue;
+        }
+
+        if (mqtt_inflight >= MQTT_MAX_INFLIGHT) {
+            pthread_cond_wait(&mqtt_publish_cond,&mqtt_publish_lock);
+            continue;
+        }
+
+        while ((mqtt_pending != NULL) && (mqtt_pending->due <= now) &&
+               (count < MQTT_PUBLISH_BATCH) && (mqtt_inflight + count < MQTT_MAX_INFLIGHT)) {
+            mqtt_publish_t *pub = mqtt_pending;
+
+            DL_DELETE(mqtt_pending,pub);
+            batch[count] = pub;
+            payloads[count] = pub->payload;
+            pub->payload = NULL;
+            // Recorded before the send, onPublishFailure may run before
+            // MQTTAsync_send returns and takes it back
+            free(pub->last);
+            pub->last = strdup(payloads[count]);
+            count++;
+        }
+
+        pthread_mutex_unlock(&mqtt_publish_lock);
+        for (a = 0; a < count; a++) {
+            if (mqtt_send((char *)batch[a]->topic,payloads[a],batch[a]) != MQTTASYNC_SUCCESS) {
+                log_printf(LOG_WARNING,"%s: send to %s failed\n",__FUNCTION__,batch[a]->topic);
+                pthread_mutex_lock(&mqtt_publish_lock);
+                if ((batch[a]->last != NULL) && (strcmp(batch[a]->last,payloads[a]) == 0)) {
+                    free(batch[a]->last);
+                    batch[a]->last = NULL;
+                }
+                pthread_mutex_unlock(&mqtt_publish_lock);
+            }
+            free(payloads[a]);
+        }
+        pthread_mutex_lock(&mqtt_publish_lock);
+    }
+
+    return NULL;
+}
+
+// After a reconnect the broker may have lost retained state, send everything again
+static void mqtt_publish_forget(void)
+{
+    struct topicmap_entry_t *entry;
+    unsigned int bucket;
+
+    pthread_mutex_lock(&mqtt_publish_lock);
+    TOPICMAP_FOREACH(&mqtt_publish_cache,bucket,entry) {
+        mqtt_publish_t *pub = entry->value;
+
+        free(pub->last);
+        pub->last = NULL;
+    }
+    pthread_mutex_unlock(&mqtt_publish_lock);
+}
+
+// The session is gone with the connection, and nothing is accepted until
+// the reconnect, so whatever was in flight is written off here. A callback
+// for it that still arrives only counts down to zero in mqtt_publish_done.
+static void mqtt_publish_lost(void)
+{
+    pthread_mutex_lock(&mqtt_publish_lock);
+    mqtt_inflight = 0;
+    metrics_gauge(METRIC_PUBLISH_INFLIGHT,0);
+    pthread_cond_signal(&mqtt_publish_cond);
+    pthread_mutex_unlock(&mqtt_publish_lock);
+}
+
+
 void onSubscribe(void* context, MQTTAsync_successData* response)
 {
     
@@ -124,7 +486,7 @@ void onSubscribeFailure(void* context, MQTTAsync_failureData* response)
 {
    mqtt_callback_ll *tmp = context;
 
-	syslog(LOG_NOTICE,"Subscribe failed, rc %d\n", response->code);
+	log_printf(LOG_ERR,"Subscribe failed, rc %d\n", response->code);
     tmp->subscribed=0;
 }
 
@@ -132,21 +494,31 @@ void onConnect(void* context, MQTTAsync_successData* response)
 {
     mqtt_callback_ll *tmp;
 
-   syslog(LOG_NOTICE,"Connected to Host\r\n");
+   log_printf(LOG_NOTICE,"Connected to Host\r\n");
+   mqtt_publish_forget();
+   if (mqtt_connect_func != NULL)
+       mqtt_connect_func(mqtt_connect_ptr);
 
     DL_FOREACH(mqtt_funcs,tmp) {
         if (tmp->subscribed==0)
         {
            mqtt_subscribe(tmp->node,tmp);
-           syslog(LOG_NOTICE,"%s -> Subscribing to %s\r\n",__FUNCTION__,tmp->node);
+           log_printf(LOG_INFO,"%s -> Subscribing to %s\r\n",__FUNCTION__,tmp->node);
         }
     }
+
+    // Last, so a waiter registering callbacks never races the loop above
+    pthread_mutex_lock(&mqtt_ready_lock);
+    mqtt_ready = 1;
+    pthread_cond_broadcast(&mqtt_ready_cond);
+    pthread_mutex_unlock(&mqtt_ready_lock);
 }
 
 void onFailure(void *context, MQTTAsync_failureData *response)
 {
 
-   syslog(LOG_NOTICE,"FAILED to connect to MQTT - Check IP, username and password\r\n");
+   log_printf(LOG_ERR,"FAILED to connect to MQTT - Check IP, username and password\r\n");
+   log_flush();
 
     exit(0);
 }
@@ -163,6 +535,7 @@ int mqtt_connect(char* url, char* clientid, char *username, char *password)
     rc = MQTTAsync_create(&client,url,clientid, MQTTCLIENT_PERSISTENCE_DEFAULT, NULL);
     
     conn_opts.keepAliveInterval = 30;
+    conn_opts.maxInflight = MQTT_MAX_INFLIGHT;
     conn_opts.cleansession = 1;
     conn_opts.automaticReconnect=1;
     conn_opts.retryInterval = 5;
@@ -174,36 +547,58 @@ int mqtt_connect(char* url, char* clientid, char *username, char *password)
 	MQTTAsync_setCallbacks(client, client, connlost, messageArrived, NULL);
     
     if((rc = MQTTAsync_connect(client, &conn_opts)) != MQTTASYNC_SUCCESS) {
-       syslog(LOG_NOTICE,"Failed to connect, return code %d\n", rc);
+       log_printf(LOG_ERR,"Failed to connect, return code %d\n", rc);
         return -1;
     }
 
     return 0;
 }
 
+// Returns 0 once the first connect has completed, -1 if it took longer
+// than timeout_ms. A refused connect exits in onFailure instead.
+int mqtt_wait_connected(int timeout_ms)
+{
+    struct timespec ts;
+    int rc = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&mqtt_ready_lock);
+    while ((mqtt_ready == 0) && (rc == 0))
+        rc = pthread_cond_timedwait(&mqtt_ready_cond,&mqtt_ready_lock,&ts);
+    rc = mqtt_ready ? 0 : -1;
+    pthread_mutex_unlock(&mqtt_ready_lock);
+    return rc;
+}
+
 void connlost(void* context, char* cause)
 {
     
     mqtt_callback_ll *tmp;
 
+    metrics_count(METRIC_MQTT_DISCONNECTS,1);
+    mqtt_publish_lost();
     DL_FOREACH(mqtt_funcs,tmp) {
         tmp->subscribed=0;
     }
-   syslog(LOG_NOTICE,"\nConnection lost\n");
-   syslog(LOG_NOTICE,"     cause: %s\n", cause);
+   log_printf(LOG_WARNING,"Connection lost, cause: %s\n", cause ? cause : "unknown");
 }
 
 int messageArrived(void *context, char *topicName, int topicLen, MQTTAsync_message *message)
 {
     int i;
     char* payloadptr;
-    mqtt_callback_ll *elt;
+    unsigned long long start = metrics_now_us();
 
+    metrics_count(METRIC_MQTT_RX,1);
 
-   syslog(LOG_NOTICE,"%s START",__FUNCTION__);
-  
-   syslog(LOG_NOTICE,"Message arrived\n");
-   syslog(LOG_NOTICE,"     topic: %s\n", topicName);
+   log_printf(LOG_DEBUG,"Message arrived on %s\n", topicName);
   // syslog(LOG_NOTICE,"   message: ");
 
   //  payloadptr = message->payload;
@@ -211,14 +606,13 @@ int messageArrived(void *context, char *topicName, int topicLen, MQTTAsync_messa
   //      putchar(*payloadptr++);
   //  }
     
-    DL_FOREACH(mqtt_funcs,elt) {
-            elt->functionPtr(topicName,message->payload,message->payloadlen,elt->dataPtr);
-    }
+    pthread_rwlock_rdlock(&mqtt_topic_lock);
+    mqtt_topic_match(&mqtt_topic_root,topicName,strlen(topicName),1,topicName,message);
+    pthread_rwlock_unlock(&mqtt_topic_lock);
     
     MQTTAsync_freeMessage(&message);
     MQTTAsync_free(topicName);
-   
-    syslog(LOG_NOTICE,"%s EXIT",__FUNCTION__);
+    metrics_observe_since(METRIC_MQTT_DISPATCH,start);
    
     
     return 1;
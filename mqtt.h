@@ -11,21 +11,51 @@ typedef struct  mqtt_callback_ll{
     int  subscribed;
     int (*functionPtr)(char *,char *,int, void *);
     struct mqtt_callback_ll *next, *prev;
+    struct mqtt_callback_ll *node_next;   // Handlers sharing one topic filter
 } mqtt_callback_ll;
 
-
-mqtt_callback_ll *mqtt_funcs;
+// One level of a subscription filter. Literal levels hang off children,
+// the MQTT wildcards get their own slots so a lookup never scans for them.
+typedef struct mqtt_topic_node {
+    char level[64];
+    struct mqtt_topic_node *children;
+    struct mqtt_topic_node *plus;       // '+' matches exactly one level
+    struct mqtt_topic_node *hash;       // '#' matches this level and everything below
+    mqtt_callback_ll *handlers;         // Filters ending at this node
+    struct mqtt_topic_node *next, *prev;
+} mqtt_topic_node;
+
+// Publish pipeline state for one topic, see mqtt_publish()
+typedef struct mqtt_publish_t {
+    const char *topic;          // Owned by the topicmap entry
+    char *payload;              // Waiting to be sent, NULL when nothing is queued
+    char *last;                 // Last payload handed to Paho, cleared if it failed
+    unsigned long long due;     // Earliest time payload may go out
+    struct mqtt_publish_t *next, *prev;
+} mqtt_publish_t;
+
+
+extern mqtt_callback_ll *mqtt_funcs;
 
 void mqtt_initfuncs(void);
 int mqtt_writedata(char *tag, char *message);
+int mqtt_publish(char *tag, char *message);
+void mqtt_set_coalesce(int ms);
 int mqtt_writeresponse(char *intag, char *message, int transaction);
 int mqtt_connect(char* url, char* clientid, char *username, char *password);
+int mqtt_wait_connected(int timeout_ms);
 void mqtt_register_callback(char *node,void *func, void *ptr);
+void mqtt_register_connect(void (*func)(void *), void *ptr);
 
-MQTTAsync client;
+extern MQTTAsync client;
 #define CLIENTID "AABBCCDDEEFF"
 #define QOS 1
 
+#define MQTT_MAX_INFLIGHT   64      // QoS 1 messages awaiting PUBACK
+#define MQTT_PUBLISH_BATCH  16      // Messages handed to Paho per flush pass
+#define MQTT_COALESCE_MS    50      // Default window for merging updates to one topic
+#define MQTT_CONNECT_WAIT_MS 10000  // How long start up waits for the broker
+
 
 
-#endif
\ No newline at end of file
+#endif
@@ -60,7 +60,7 @@ AS       := as
 ## User defined environment variables
 ##
 CodeLiteDir:=/usr/share/codelite
-Objects0=$(IntermediateDirectory)/mqtt.c$(ObjectSuffix) $(IntermediateDirectory)/main.c$(ObjectSuffix) $(IntermediateDirectory)/socketclient.c$(ObjectSuffix) 
+Objects0=$(IntermediateDirectory)/mqtt.c$(ObjectSuffix) $(IntermediateDirectory)/main.c$(ObjectSuffix) $(IntermediateDirectory)/socketclient.c$(ObjectSuffix) $(IntermediateDirectory)/jsonframer.c$(ObjectSuffix) $(IntermediateDirectory)/fastjson.c$(ObjectSuffix) $(IntermediateDirectory)/topicmap.c$(ObjectSuffix) $(IntermediateDirectory)/metrics.c$(ObjectSuffix) $(IntermediateDirectory)/log.c$(ObjectSuffix) $(IntermediateDirectory)/idmap.c$(ObjectSuffix) 
 
 
 
@@ -115,6 +115,54 @@ $(IntermediateDirectory)/socketclient.c$(DependSuffix): socketclient.c
 $(IntermediateDirectory)/socketclient.c$(PreprocessSuffix): socketclient.c
 	$(CC) $(CFLAGS) $(IncludePath) $(PreprocessOnlySwitch) $(OutputSwitch) $(IntermediateDirectory)/socketclient.c$(PreprocessSuffix) socketclient.c
 
+$(IntermediateDirectory)/jsonframer.c$(ObjectSuffix): jsonframer.c $(IntermediateDirectory)/jsonframer.c$(DependSuffix)
+	$(CC) $(SourceSwitch) "/home/richard/Documents/Workspace/rako_adapter/jsonframer.c" $(CFLAGS) $(ObjectSwitch)$(IntermediateDirectory)/jsonframer.c$(ObjectSuffix) $(IncludePath)
+$(IntermediateDirectory)/jsonframer.c$(DependSuffix): jsonframer.c
+	@$(CC) $(CFLAGS) $(IncludePath) -MG -MP -MT$(IntermediateDirectory)/jsonframer.c$(ObjectSuffix) -MF$(IntermediateDirectory)/jsonframer.c$(DependSuffix) -MM jsonframer.c
+
+$(IntermediateDirectory)/jsonframer.c$(PreprocessSuffix): jsonframer.c
+	$(CC) $(CFLAGS) $(IncludePath) $(PreprocessOnlySwitch) $(OutputSwitch) $(IntermediateDirectory)/jsonframer.c$(PreprocessSuffix) jsonframer.c
+
+$(IntermediateDirectory)/fastjson.c$(ObjectSuffix): fastjson.c $(IntermediateDirectory)/fastjson.c$(DependSuffix)
+	$(CC) $(SourceSwitch) "/home/richard/Documents/Workspace/rako_adapter/fastjson.c" $(CFLAGS) $(ObjectSwitch)$(IntermediateDirectory)/fastjson.c$(ObjectSuffix) $(IncludePath)
+$(IntermediateDirectory)/fastjson.c$(DependSuffix): fastjson.c
+	@$(CC) $(CFLAGS) $(IncludePath) -MG -MP -MT$(IntermediateDirectory)/fastjson.c$(ObjectSuffix) -MF$(IntermediateDirectory)/fastjson.c$(DependSuffix) -MM fastjson.c
+
+$(IntermediateDirectory)/fastjson.c$(PreprocessSuffix): fastjson.c
+	$(CC) $(CFLAGS) $(IncludePath) $(PreprocessOnlySwitch) $(OutputSwitch) $(IntermediateDirectory)/fastjson.c$(PreprocessSuffix) fastjson.c
+
+$(IntermediateDirectory)/topicmap.c$(ObjectSuffix): topicmap.c $(IntermediateDirectory)/topicmap.c$(DependSuffix)
+	$(CC) $(SourceSwitch) "/home/richard/Documents/Workspace/rako_adapter/topicmap.c" $(CFLAGS) $(ObjectSwitch)$(IntermediateDirectory)/topicmap.c$(ObjectSuffix) $(IncludePath)
+$(IntermediateDirectory)/topicmap.c$(DependSuffix): topicmap.c
+	@$(CC) $(CFLAGS) $(IncludePath) -MG -MP -MT$(IntermediateDirectory)/topicmap.c$(ObjectSuffix) -MF$(IntermediateDirectory)/topicmap.c$(DependSuffix) -MM topicmap.c
+
+$(IntermediateDirectory)/topicmap.c$(PreprocessSuffix): topicmap.c
+	$(CC) $(CFLAGS) $(IncludePath) $(PreprocessOnlySwitch) $(OutputSwitch) $(IntermediateDirectory)/topicmap.c$(PreprocessSuffix) topicmap.c
+
+$(IntermediateDirectory)/metrics.c$(ObjectSuffix): metrics.c $(IntermediateDirectory)/metrics.c$(DependSuffix)
+	$(CC) $(SourceSwitch) "/home/richard/Documents/Workspace/rako_adapter/metrics.c" $(CFLAGS) $(ObjectSwitch)$(IntermediateDirectory)/metrics.c$(ObjectSuffix) $(IncludePath)
+$(IntermediateDirectory)/metrics.c$(DependSuffix): metrics.c
+	@$(CC) $(CFLAGS) $(IncludePath) -MG -MP -MT$(IntermediateDirectory)/metrics.c$(ObjectSuffix) -MF$(IntermediateDirectory)/metrics.c$(DependSuffix) -MM metrics.c
+
+$(IntermediateDirectory)/metrics.c$(PreprocessSuffix): metrics.c
+	$(CC) $(CFLAGS) $(IncludePath) $(PreprocessOnlySwitch) $(OutputSwitch) $(IntermediateDirectory)/metrics.c$(PreprocessSuffix) metrics.c
+
+$(IntermediateDirectory)/log.c$(ObjectSuffix): log.c $(IntermediateDirectory)/log.c$(DependSuffix)
+	$(CC) $(SourceSwitch) "/home/richard/Documents/Workspace/rako_adapter/log.c" $(CFLAGS) $(ObjectSwitch)$(IntermediateDirectory)/log.c$(ObjectSuffix) $(IncludePath)
+$(IntermediateDirectory)/log.c$(DependSuffix): log.c
+	@$(CC) $(CFLAGS) $(IncludePath) -MG -MP -MT$(IntermediateDirectory)/log.c$(ObjectSuffix) -MF$(IntermediateDirectory)/log.c$(DependSuffix) -MM log.c
+
+$(IntermediateDirectory)/log.c$(PreprocessSuffix): log.c
+	$(CC) $(CFLAGS) $(IncludePath) $(PreprocessOnlySwitch) $(OutputSwitch) $(IntermediateDirectory)/log.c$(PreprocessSuffix) log.c
+
+$(IntermediateDirectory)/idmap.c$(ObjectSuffix): idmap.c $(IntermediateDirectory)/idmap.c$(DependSuffix)
+	$(CC) $(SourceSwitch) "/home/richard/Documents/Workspace/rako_adapter/idmap.c" $(CFLAGS) $(ObjectSwitch)$(IntermediateDirectory)/idmap.c$(ObjectSuffix) $(IncludePath)
+$(IntermediateDirectory)/idmap.c$(DependSuffix): idmap.c
+	@$(CC) $(CFLAGS) $(IncludePath) -MG -MP -MT$(IntermediateDirectory)/idmap.c$(ObjectSuffix) -MF$(IntermediateDirectory)/idmap.c$(DependSuffix) -MM idmap.c
+
+$(IntermediateDirectory)/idmap.c$(PreprocessSuffix): idmap.c
+	$(CC) $(CFLAGS) $(IncludePath) $(PreprocessOnlySwitch) $(OutputSwitch) $(IntermediateDirectory)/idmap.c$(PreprocessSuffix) idmap.c
+
 
 -include $(IntermediateDirectory)/*$(DependSuffix)
 ##
@@ -1,40 +1,196 @@
 #include "socketclient.h"
+#include "metrics.h"
+#include "log.h"
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 
-void* socket_client_main_thread(void* paramPtr);
+static void* socket_loop_thread(void* paramPtr);
 
-void socket_client_start(struct socket_client_t* s)
+struct socket_loop_t *socket_loop_create(void)
+{
+    struct socket_loop_t *loop = calloc(1, sizeof(struct socket_loop_t));
+    struct epoll_event ev;
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ((loop->epoll_fd < 0) || (loop->wake_fd < 0)) {
+        log_printf(LOG_ERR,"epoll_create1 failed: %s\r\n",strerror(errno));
+        return NULL;
+    }
+
+    // The eventfd is the only entry without a client behind it
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev);
+    return loop;
+}
+
+// Clients are added before the loop starts and stay for its lifetime
+void socket_loop_add(struct socket_loop_t* loop, struct socket_client_t* s)
 {
-    pthread_t socket_thread;
+    pthread_condattr_t condattr;
+
+    s->loop = loop;
+    s->sock = -1;
+    s->state = 0;
+    s->retry_at = 0;
+    s->backoff_ms = SOCKET_RETRY_MIN_MS;
+    s->jitter_seed = (unsigned int)time(NULL) ^ (unsigned int)(uintptr_t)s;
+    s->rx_head = 0;
+    s->rx_tail = 0;
+
+    // Writers may show up before the thread runs, set the queue up here
+    s->tx_head = 0;
+    s->tx_tail = 0;
+    pthread_mutex_init(&s->tx_lock, NULL);
+    pthread_mutex_init(&s->timer_lock, NULL);
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&s->tx_space, &condattr);
 
+    s->next = loop->clients;
+    loop->clients = s;
+}
+
+void socket_loop_start(struct socket_loop_t* loop)
+{
     pthread_attr_t attributes;
+
     pthread_attr_init(&attributes);
     pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
-    s->sock = -1;
-    pthread_create(&socket_thread, &attributes, socket_client_main_thread, s);
+    loop->RUNNING = 1;
+    pthread_create(&loop->thread, &attributes, socket_loop_thread, loop);
+}
 
-    return;
+void socket_client_start(struct socket_client_t* s)
+{
+    struct socket_loop_t *loop = socket_loop_create();
+
+    if (loop == NULL)
+        return;
+    socket_loop_add(loop, s);
+    socket_loop_start(loop);
 }
 
-void socket_client_write(struct socket_client_t* s,  char *buffer, int len)
+static int socket_client_on_loop(struct socket_client_t* s)
 {
-    if (s->RUNNING == 1) {
-        send(s->sock,buffer,len, 0);
-        usleep(100);
+    return pthread_equal(pthread_self(), s->loop->thread);
+}
+
+static void socket_client_wakeup(struct socket_client_t* s)
+{
+    uint64_t one = 1;
+
+    if (write(s->loop->wake_fd, &one, sizeof(one)) < 0) {
+        // Counter already non zero, the loop thread is due to wake anyway
     }
+}
+
+// Queues len bytes for the hub. Returns 0 once queued, -1 when not connected
+// or when the queue stayed full. Writers on other threads wait up to
+// SOCKET_TX_BLOCK_MS for room, the loop thread itself never blocks here.
+int socket_client_write(struct socket_client_t* s,  char *buffer, int len)
+{
+    int self = socket_client_on_loop(s);
+    unsigned int off, first;
+    int was_empty;
+
+    if ((len <= 0) || (len > SOCKET_TX_BUFFER_SIZE))
+        return -1;
+
+    pthread_mutex_lock(&s->tx_lock);
+
+    if (self == 0) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec += SOCKET_TX_BLOCK_MS / 1000;
+        ts.tv_nsec += (SOCKET_TX_BLOCK_MS % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        while ((s->state == 2) && (SOCKET_TX_BUFFER_SIZE - (s->tx_head - s->tx_tail) < (unsigned int)len)) {
+            if (pthread_cond_timedwait(&s->tx_space, &s->tx_lock, &ts) != 0)
+                break;
+        }
+    }
+
+    if ((s->state != 2) || (SOCKET_TX_BUFFER_SIZE - (s->tx_head - s->tx_tail) < (unsigned int)len)) {
+        pthread_mutex_unlock(&s->tx_lock);
+        return -1;
+    }
+
+    was_empty = (s->tx_head == s->tx_tail);
+    off = s->tx_head & (SOCKET_TX_BUFFER_SIZE - 1);
+    first = SOCKET_TX_BUFFER_SIZE - off;
+    if (first > (unsigned int)len)
+        first = len;
+    memcpy(s->tx_buffer + off, buffer, first);
+    memcpy(s->tx_buffer, buffer + first, len - first);
+    s->tx_head += len;
+
+    pthread_mutex_unlock(&s->tx_lock);
+
+    // The loop thread flushes before it sleeps again, only others need a kick
+    if (was_empty && (self == 0))
+        socket_client_wakeup(s);
+    return 0;
+}
+
+
+unsigned long long socket_client_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void socket_client_timer_start(struct socket_client_t* s, int id, int delay_ms, int interval_ms, int (*func)(void *,struct socket_client_t*))
+{
+    if ((id < 0) || (id >= SOCKET_MAX_TIMERS))
+        return;
+
+    pthread_mutex_lock(&s->timer_lock);
+    s->timers[id].deadline = socket_client_now() + delay_ms;
+    s->timers[id].interval = interval_ms;
+    s->timers[id].func = func;
+    s->timers[id].armed = 1;
+    pthread_mutex_unlock(&s->timer_lock);
+
+    // epoll_wait may be sleeping towards a later deadline
+    if (socket_client_on_loop(s) == 0)
+        socket_client_wakeup(s);
+    return;
+}
+
+void socket_client_timer_stop(struct socket_client_t* s, int id)
+{
+    if ((id < 0) || (id >= SOCKET_MAX_TIMERS))
+        return;
+
+    pthread_mutex_lock(&s->timer_lock);
+    s->timers[id].armed = 0;
+    pthread_mutex_unlock(&s->timer_lock);
     return;
 }
 
@@ -66,80 +222,405 @@ int main(int argc, char *argv[])
 }
 #endif
 
-void* socket_client_main_thread(void* paramPtr)
+// Picks the next retry time, backing off while attempts keep failing
+static void socket_client_backoff(struct socket_client_t* params)
 {
+    unsigned long long now = socket_client_now();
+    int half;
 
-    struct socket_client_t* params = paramPtr;
-    struct sockaddr_in server;
+    if ((params->connected_at != 0) && (now - params->connected_at >= SOCKET_STABLE_MS)) {
+        params->backoff_ms = SOCKET_RETRY_MIN_MS;
+        params->failures = 0;
+    }
 
-    int socket_desc;
+    half = params->backoff_ms / 2;
+    params->retry_at = now + half + rand_r(&params->jitter_seed) % (half + 1);
+    params->failures++;
+
+    params->backoff_ms *= 2;
+    if (params->backoff_ms > SOCKET_RETRY_MAX_MS)
+        params->backoff_ms = SOCKET_RETRY_MAX_MS;
+}
+
+// Drops the connection, the loop connects again once the backoff expires
+static void socket_client_close(struct socket_client_t* params)
+{
+    unsigned long long now = socket_client_now();
+
+    if (params->state == 2) {
+        metrics_count(METRIC_HUB_DISCONNECTS, 1);
+        log_printf(LOG_WARNING,"Lost %s:%d after %llus\r\n",params->host,params->port,(now - params->connected_at) / 1000);
+        params->down_since = now;
+    } else {
+        metrics_count(METRIC_HUB_CONNECT_FAILURES, 1);
+    }
+    if (params->sock >= 0) {
+        epoll_ctl(params->loop->epoll_fd, EPOLL_CTL_DEL, params->sock, NULL);
+        close(params->sock);
+    }
+    params->sock = -1;
+    socket_client_backoff(params);
+    params->connected_at = 0;
+    log_printf(LOG_INFO,"Connecting to %s:%d again in %llums\r\n",params->host,params->port,params->retry_at - now);
+    params->rx_head = 0;
+    params->rx_tail = 0;
 
+    pthread_mutex_lock(&params->timer_lock);
+    memset(params->timers, 0, sizeof(params->timers));
+    pthread_mutex_unlock(&params->timer_lock);
 
-    params->RUNNING=1;
+    // Anything still queued was meant for the old session
+    pthread_mutex_lock(&params->tx_lock);
     params->state = 0;
+    params->tx_head = 0;
+    params->tx_tail = 0;
+    params->tx_pollout = 0;
+    pthread_cond_broadcast(&params->tx_space);
+    pthread_mutex_unlock(&params->tx_lock);
+}
 
-    while(params->RUNNING == 1) {
+static void socket_client_pollout(struct socket_client_t* params, int enable)
+{
+    struct epoll_event ev;
 
-        if(params->state == 0) {
-            params->sock = socket(AF_INET, SOCK_STREAM, 0);
-            if(params->sock == -1) {
-                printf("Could not create socket");
-                pthread_exit(NULL);
-            }
-            fcntl(params->sock, F_SETFL, O_NONBLOCK);
+    if (params->tx_pollout == enable)
+        return;
 
-            server.sin_addr.s_addr = inet_addr(params->host);
-            server.sin_family = AF_INET;
-            server.sin_port = htons( params->port );
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP | (enable ? EPOLLOUT : 0);
+    ev.data.ptr = params;
+    epoll_ctl(params->loop->epoll_fd, EPOLL_CTL_MOD, params->sock, &ev);
+    params->tx_pollout = enable;
+}
 
-            params->state = 1;
-            continue;
-        } // State == 0
-
-        if(params->state == 1) {
-            int rc;
-            rc = connect(params->sock, (struct sockaddr*)&server, sizeof(server));
-            if(rc < 0) {
-                perror("connect failed. Error");
-                sleep(1);
-            } else {
-                if(params->func_connected != NULL) {
-                    params->func_connected(params->pvt,params,params->sock);
-                }
-                params->state = 2;
+// Sends as much of the transmit queue as the socket takes, all queued frames
+// go out in one sendmsg. Leftovers wait for EPOLLOUT. Returns -1 on a dead socket.
+static int socket_client_flush(struct socket_client_t* params)
+{
+    while (1) {
+        struct iovec iov[2];
+        struct msghdr msg;
+        unsigned int head, tail, off, len;
+        ssize_t rc;
+
+        pthread_mutex_lock(&params->tx_lock);
+        head = params->tx_head;
+        tail = params->tx_tail;
+        pthread_mutex_unlock(&params->tx_lock);
+
+        if (head == tail) {
+            socket_client_pollout(params, 0);
+            return 0;
+        }
+
+        // Writers only append past head, so the bytes between tail and head are stable
+        len = head - tail;
+        off = tail & (SOCKET_TX_BUFFER_SIZE - 1);
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 1;
+        iov[0].iov_base = params->tx_buffer + off;
+        iov[0].iov_len = SOCKET_TX_BUFFER_SIZE - off;
+        if (iov[0].iov_len >= len) {
+            iov[0].iov_len = len;
+        } else {
+            iov[1].iov_base = params->tx_buffer;
+            iov[1].iov_len = len - iov[0].iov_len;
+            msg.msg_iovlen = 2;
+        }
+
+        rc = sendmsg(params->sock, &msg, MSG_NOSIGNAL);
+        if (rc < 0) {
+            if (errno == EINTR)
                 continue;
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                socket_client_pollout(params, 1);
+                return 0;
             }
-        } // State == 1
-
-        if(params->state == 2) {
-            int rc;
-            rc = recv(params->sock, params->buffer, MAX_BUFFER_SIZE, 0);
-            if(rc == 0) {
-                close(params->sock);
-                params->sock = -1;
-                params->state = 0;
+            log_printf(LOG_WARNING,"send failed: %s\r\n",strerror(errno));
+            return -1;
+        }
+
+        metrics_count(METRIC_HUB_TX_BYTES, rc);
+        pthread_mutex_lock(&params->tx_lock);
+        params->tx_tail += rc;
+        pthread_cond_broadcast(&params->tx_space);
+        pthread_mutex_unlock(&params->tx_lock);
+    }
+}
+
+// Milliseconds until the next timer is due, -1 to block until the socket is readable
+static int socket_client_next_timeout(struct socket_client_t* params)
+{
+    unsigned long long now = socket_client_now();
+    long long next = -1;
+    int a;
+
+    pthread_mutex_lock(&params->timer_lock);
+    for (a = 0; a < SOCKET_MAX_TIMERS; a++) {
+        if (params->timers[a].armed == 0)
+            continue;
+        if (params->timers[a].deadline <= now) {
+            next = 0;
+            break;
+        }
+        if ((next < 0) || ((long long)(params->timers[a].deadline - now) < next))
+            next = params->timers[a].deadline - now;
+    }
+    pthread_mutex_unlock(&params->timer_lock);
+    return (int)next;
+}
+
+static int socket_client_run_timers(struct socket_client_t* params)
+{
+    unsigned long long now = socket_client_now();
+    int a;
+
+    for (a = 0; a < SOCKET_MAX_TIMERS; a++) {
+        struct socket_timer_t *t = &params->timers[a];
+        int (*func)(void *,struct socket_client_t*);
+
+        pthread_mutex_lock(&params->timer_lock);
+        if ((t->armed == 0) || (t->deadline > now)) {
+            pthread_mutex_unlock(&params->timer_lock);
+            continue;
+        }
+
+        if (t->interval > 0) {
+            // Stay on the original cadence, but never try to catch up on missed periods
+            t->deadline += t->interval;
+            if (t->deadline <= now)
+                t->deadline = now + t->interval;
+        } else {
+            t->armed = 0;
+        }
+        func = t->func;
+        pthread_mutex_unlock(&params->timer_lock);
+
+        // Called unlocked, callbacks start and stop timers themselves
+        if (func(params->pvt,params) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+// Hand everything between rx_tail and rx_head to func_parse, at most two
+// spans when the data wraps the end of the ring
+static void socket_client_deliver(struct socket_client_t* params)
+{
+    while (params->rx_tail != params->rx_head) {
+        unsigned int off = params->rx_tail & (SOCKET_RX_BUFFER_SIZE - 1);
+        unsigned int len = params->rx_head - params->rx_tail;
+
+        if (len > SOCKET_RX_BUFFER_SIZE - off)
+            len = SOCKET_RX_BUFFER_SIZE - off;
+
+        if (params->func_parse != NULL) {
+            params->func_parse(params->pvt,params,params->sock, params->buffer + off, len);
+        }
+        params->rx_tail += len;
+    }
+}
+
+// Drain the socket into the ring. Returns 0 when the socket would block,
+// -1 when the peer closed or the connection failed
+static int socket_client_read(struct socket_client_t* params)
+{
+    while (1) {
+        struct iovec iov[2];
+        unsigned int off = params->rx_head & (SOCKET_RX_BUFFER_SIZE - 1);
+        unsigned int space = SOCKET_RX_BUFFER_SIZE - (params->rx_head - params->rx_tail);
+        int iovcnt = 1;
+        ssize_t rc;
+
+        iov[0].iov_base = params->buffer + off;
+        iov[0].iov_len = SOCKET_RX_BUFFER_SIZE - off;
+        if (iov[0].iov_len > space)
+            iov[0].iov_len = space;
+        if (space > iov[0].iov_len) {
+            iov[1].iov_base = params->buffer;
+            iov[1].iov_len = space - iov[0].iov_len;
+            iovcnt = 2;
+        }
+
+        rc = readv(params->sock, iov, iovcnt);
+        if (rc == 0)
+            return -1;
+        if (rc < 0) {
+            if (errno == EINTR)
                 continue;
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                return 0;
+            log_printf(LOG_WARNING,"recv failed: %s\r\n",strerror(errno));
+            return -1;
+        }
+
+        metrics_count(METRIC_HUB_RX_BYTES, rc);
+        params->rx_head += rc;
+        params->last_rx = socket_client_now();
+        socket_client_deliver(params);
+
+        // A short read means the kernel buffer is empty, skip the extra syscall
+        if ((unsigned int)rc < space)
+            return 0;
+    }
+}
+
+// Starts a non-blocking connect. The result arrives as EPOLLOUT while the
+// client sits in state 1.
+static void socket_client_connect(struct socket_client_t* params)
+{
+    struct sockaddr_in server;
+    struct epoll_event ev;
+    int rc;
+
+    params->sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (params->sock == -1) {
+        log_printf(LOG_ERR,"Could not create socket: %s\r\n",strerror(errno));
+        socket_client_backoff(params);
+        return;
+    }
+
+    memset(&server, 0, sizeof(server));
+    server.sin_addr.s_addr = inet_addr(params->host);
+    server.sin_family = AF_INET;
+    server.sin_port = htons( params->port );
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLOUT | EPOLLRDHUP;
+    ev.data.ptr = params;
+    epoll_ctl(params->loop->epoll_fd, EPOLL_CTL_ADD, params->sock, &ev);
+    params->tx_pollout = 1;
+    params->state = 1;
+    params->retry_at = socket_client_now() + SOCKET_CONNECT_TIMEOUT_MS;
+
+    rc = connect(params->sock, (struct sockaddr*)&server, sizeof(server));
+    if ((rc < 0) && (errno != EINPROGRESS)) {
+        log_printf(LOG_WARNING,"connect to %s:%d failed: %s\r\n",params->host,params->port,strerror(errno));
+        socket_client_close(params);
+    }
+}
+
+// The connect finished one way or the other
+static void socket_client_connected(struct socket_client_t* params)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if ((getsockopt(params->sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0) || (err != 0)) {
+        log_printf(LOG_WARNING,"connect to %s:%d failed: %s\r\n",params->host,params->port,strerror(err ? err : errno));
+        socket_client_close(params);
+        return;
+    }
+
+    socket_client_pollout(params, 0);
+    metrics_count(METRIC_HUB_CONNECTS, 1);
+    params->connected_at = socket_client_now();
+    params->last_rx = params->connected_at;
+    params->sessions++;
+    if (params->down_since != 0)
+        log_printf(LOG_NOTICE,"Reconnected to %s:%d after %llums, %u attempts\r\n",params->host,params->port,
+                   params->connected_at - params->down_since,params->failures);
+
+    // Open the transmit queue before func_connected sends the handshake
+    pthread_mutex_lock(&params->tx_lock);
+    params->state = 2;
+    pthread_mutex_unlock(&params->tx_lock);
+
+    if(params->func_connected != NULL) {
+        params->func_connected(params->pvt,params,params->sock);
+    }
+}
+
+// Milliseconds until some client on the loop has work, -1 to wait for I/O only
+static int socket_loop_next_timeout(struct socket_loop_t* loop)
+{
+    unsigned long long now = socket_client_now();
+    struct socket_client_t* s;
+    int next = -1;
+
+    for (s = loop->clients; s != NULL; s = s->next) {
+        int t = -1;
+
+        if ((s->state == 0) || (s->state == 1))
+            t = (s->retry_at > now) ? (int)(s->retry_at - now) : 0;
+        else if (s->state == 2)
+            t = socket_client_next_timeout(s);
+
+        if ((t >= 0) && ((next < 0) || (t < next)))
+            next = t;
+    }
+    return next;
+}
+
+static void socket_loop_event(struct socket_client_t* params, uint32_t events)
+{
+    if (params->state == 1) {
+        if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+            socket_client_connected(params);
+        return;
+    }
+    if (params->state != 2)
+        return;
+
+    if (events & EPOLLOUT) {
+        if (socket_client_flush(params) < 0) {
+            socket_client_close(params);
+            return;
+        }
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        if (socket_client_read(params) < 0)
+            socket_client_close(params);
+    }
+}
+
+static void* socket_loop_thread(void* paramPtr)
+{
+    struct socket_loop_t* loop = paramPtr;
+    struct socket_client_t* s;
+
+    while(loop->RUNNING == 1) {
+        struct epoll_event events[SOCKET_MAX_EVENTS];
+        unsigned long long now = socket_client_now();
+        int rc, a;
+
+        for (s = loop->clients; s != NULL; s = s->next) {
+            if ((s->state == 0) && (s->retry_at <= now))
+                socket_client_connect(s);
+            else if ((s->state == 1) && (s->retry_at <= now)) {
+                log_printf(LOG_WARNING,"connect to %s:%d timed out\r\n",s->host,s->port);
+                socket_client_close(s);
             }
 
-            if(rc > 0) {
-                if(params->func_parse != NULL) {
-                    params->func_parse(params->pvt,params,params->sock, params->buffer, rc);
-                }
-            } else { // Got a reponse for something!
-                if (params->func_idle != NULL) {
-                    rc = params->func_idle(params->pvt,params);
-                    if (rc < 0 )
-                    {
-                        close(params->sock);
-                        params->sock = -1;
-                        params->state = 0;
-                        continue;
-                    }
-                    
+            // Frames queued by callbacks on this thread go out before we sleep
+            if ((s->state == 2) && (socket_client_flush(s) < 0))
+                socket_client_close(s);
+        }
+
+        rc = epoll_wait(loop->epoll_fd, events, SOCKET_MAX_EVENTS, socket_loop_next_timeout(loop));
+        if ((rc < 0) && (errno != EINTR)) {
+            log_printf(LOG_ERR,"epoll_wait failed: %s\r\n",strerror(errno));
+            sleep(1);
+            continue;
+        }
+
+        for (a = 0; a < rc; a++) {
+            if (events[a].data.ptr == NULL) {
+                uint64_t count;
+
+                if (read(loop->wake_fd, &count, sizeof(count)) < 0) {
+                    // Already drained
                 }
+                continue;
             }
-        } // End of state == 2
+            socket_loop_event(events[a].data.ptr, events[a].events);
+        }
 
+        for (s = loop->clients; s != NULL; s = s->next) {
+            if ((s->state == 2) && (socket_client_run_timers(s) < 0))
+                socket_client_close(s);
+        }
     } // End of RUNNING == 1;
 
     pthread_exit(0);
@@ -3,25 +3,95 @@
 
 #include <pthread.h>
  
-#define MAX_BUFFER_SIZE 1
+// Receive and transmit rings, must be powers of two
+#define SOCKET_RX_BUFFER_SIZE 8192
+#define SOCKET_TX_BUFFER_SIZE 16384
+// How long a writer on another thread waits for room in the transmit ring
+#define SOCKET_TX_BLOCK_MS 1000
+// Timer slots per connection, ids are chosen by the owner of pvt
+#define SOCKET_MAX_TIMERS 8
+// Pause before connecting again after a refused or dropped connection. It
+// doubles with every failure up to the maximum, half of it is random so a
+// hub coming back is not met by every client at the same instant.
+#define SOCKET_RETRY_MIN_MS 500
+#define SOCKET_RETRY_MAX_MS 60000
+// A session that lasted this long resets the pause to the minimum
+#define SOCKET_STABLE_MS 30000
+// Give up on a connect the hub never answers
+#define SOCKET_CONNECT_TIMEOUT_MS 5000
+// epoll events taken per wakeup, shared by every client on a loop
+#define SOCKET_MAX_EVENTS 16
+
+struct socket_client_t;
+
+// One thread and one epoll set serving any number of clients
+struct socket_loop_t {
+    int epoll_fd;
+    int wake_fd;            // eventfd, kicks epoll_wait when another thread queues data
+    int RUNNING;
+    pthread_t thread;
+    struct socket_client_t *clients;    // Fixed once socket_loop_start() is called
+};
+
+struct socket_timer_t {
+    int armed;
+    unsigned long long deadline;    // CLOCK_MONOTONIC, milliseconds
+    int interval;                   // Milliseconds, 0 for a one shot timer
+    int (*func)(void *pvt,struct socket_client_t*);
+};
+
 struct socket_client_t {
     void *pvt;
+    struct socket_loop_t *loop;
+    struct socket_client_t *next;
     int sock;
-    int state; 
+    int state;              // 0 idle, 1 connecting, 2 connected
     int port;
-    char host[32];
-    int RUNNING;
-    char buffer[MAX_BUFFER_SIZE];
+    char host[64];          // Holds a whole -r address, the port is split off in place
+    unsigned long long retry_at;    // State 0: next connect attempt, state 1: connect timeout
+
+    // Connection health, maintained by the loop, read only elsewhere
+    int backoff_ms;                 // Pause before the next retry, before jitter
+    unsigned int failures;          // Attempts since the last stable session
+    unsigned int sessions;          // Successful connects, 1 during the first session
+    unsigned long long connected_at;    // 0 while not connected
+    unsigned long long down_since;      // When the last session ended, 0 before the first
+    unsigned long long last_rx;         // Last byte from the hub
+    unsigned int jitter_seed;
+    char buffer[SOCKET_RX_BUFFER_SIZE];
+    unsigned int rx_head;   // Next byte recv() writes
+    unsigned int rx_tail;   // Next byte handed to func_parse
+    struct socket_timer_t timers[SOCKET_MAX_TIMERS];
+    pthread_mutex_t timer_lock;
+
+    // Outbound queue, any thread appends, the socket thread drains it
+    char tx_buffer[SOCKET_TX_BUFFER_SIZE];
+    unsigned int tx_head;   // Next byte socket_client_write() fills
+    unsigned int tx_tail;   // Next byte sent to the hub
+    int tx_pollout;         // EPOLLOUT is armed for a partial write
+    pthread_mutex_t tx_lock;
+    pthread_cond_t tx_space;
     
     int (*func_connected)(void *,struct socket_client_t*, int);
     int (*func_disconnected)(int);
     int (*func_parse)(void *,struct socket_client_t*,int, char*, int);
-    int (*func_idle)(void *pvt,struct socket_client_t*);
 };
 
 
+struct socket_loop_t *socket_loop_create(void);
+void socket_loop_add(struct socket_loop_t* loop, struct socket_client_t* s);
+void socket_loop_start(struct socket_loop_t* loop);
+
+// Runs s on a loop of its own
 void socket_client_start(struct socket_client_t* s);
-void socket_client_write(struct socket_client_t* s,  char *buffer, int len);
+int socket_client_write(struct socket_client_t* s,  char *buffer, int len);
+
+// Timers run on the loop thread and are cleared when the connection drops.
+// They may be started or stopped from any thread. A callback returning < 0
+// closes the connection.
+unsigned long long socket_client_now(void);
+void socket_client_timer_start(struct socket_client_t* s, int id, int delay_ms, int interval_ms, int (*func)(void *,struct socket_client_t*));
+void socket_client_timer_stop(struct socket_client_t* s, int id);
 
 
-#endif
\ No newline at end of file
+#endif
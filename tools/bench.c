@@ -0,0 +1,489 @@
+#include "hubsim.h"
+#include "mqttsim.h"
+#include "fastjson.h"
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Drives rako_adapter between a simulated hub and a stand-in broker and
+// measures both directions:
+//   events   - tracker written by the hub -> state PUBLISH arriving at the broker
+//   commands - PUBLISH on .../set from the broker -> send frame arriving at the hub
+
+#define BENCH_PENDING       64
+#define BENCH_MAX_SAMPLES   (4 * 1024 * 1024)
+#define BENCH_READY_SECS    60
+#define BENCH_GRACE_US      2000000ULL
+
+struct bench_pending_t {
+    int level;
+    unsigned long long t0;
+};
+
+// Values written on one channel and not yet seen at the far end, oldest first
+struct bench_track_t {
+    struct bench_pending_t q[BENCH_PENDING];
+    unsigned int head;
+    unsigned int tail;
+    int last;
+};
+
+struct bench_dir_t {
+    const char *name;
+    struct bench_track_t *track;    // Indexed by bench_slot()
+    unsigned int *samples;  // Latencies in microseconds
+    unsigned long count;
+    unsigned long sent;
+    unsigned long matched;
+    unsigned long superseded;   // Overwritten by a newer value before delivery, coalescing
+};
+
+struct bench_result_t {
+    unsigned long sent;
+    unsigned long matched;
+    unsigned long superseded;
+    unsigned long backlog;      // Outstanding when the generator stopped
+    unsigned long lost;         // Still outstanding after the grace period
+    double p50, p99, p999, max;
+};
+
+struct bench_t {
+    struct hubsim_t hub;
+    struct mqttsim_t broker;
+    pthread_mutex_t lock;
+    struct bench_dir_t events;
+    struct bench_dir_t commands;
+    struct bench_dir_t *measuring;
+    int rooms;
+    int channels;
+    char *configs;                  // Indexed by bench_slot()
+    int config_count;
+    unsigned int seed;
+};
+
+static volatile int running = 1;
+
+static void stop_handler(int sig)
+{
+    running = 0;
+}
+
+// Room and channel ids start at 1, the tables are sized to the house the
+// simulator serves. Returns -1 for anything outside it.
+static int bench_slot(struct bench_t *b, int room, int channel)
+{
+    if ((room < 0) || (room > b->rooms) || (channel < 0) || (channel > b->channels))
+        return -1;
+    return room * (b->channels + 1) + channel;
+}
+
+static int bench_slots(struct bench_t *b)
+{
+    return (b->rooms + 1) * (b->channels + 1);
+}
+
+static void bench_expect(struct bench_t *b, struct bench_dir_t *d, int room, int channel, int level, unsigned long long t0)
+{
+    struct bench_track_t *t = &d->track[bench_slot(b, room, channel)];
+
+    pthread_mutex_lock(&b->lock);
+    if (t->tail - t->head >= BENCH_PENDING) {
+        t->head++;
+        d->superseded++;
+    }
+    t->q[t->tail % BENCH_PENDING].level = level;
+    t->q[t->tail % BENCH_PENDING].t0 = t0;
+    t->tail++;
+    t->last = level;
+    d->sent++;
+    pthread_mutex_unlock(&b->lock);
+}
+
+// Anything queued ahead of the matched value was coalesced away by the adapter
+static void bench_match(struct bench_t *b, struct bench_dir_t *d, int room, int channel, int level, unsigned long long now)
+{
+    struct bench_track_t *t;
+    unsigned int a;
+    int slot = bench_slot(b, room, channel);
+
+    if (slot < 0)
+        return;
+
+    pthread_mutex_lock(&b->lock);
+    if (b->measuring == d) {
+        t = &d->track[slot];
+        for (a = t->head; a != t->tail; a++) {
+            struct bench_pending_t *p = &t->q[a % BENCH_PENDING];
+
+            if (p->level != level)
+                continue;
+            d->superseded += a - t->head;
+            d->matched++;
+            if (d->count < BENCH_MAX_SAMPLES)
+                d->samples[d->count++] = now - p->t0;
+            t->head = a + 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&b->lock);
+}
+
+static unsigned long bench_outstanding(struct bench_t *b, struct bench_dir_t *d)
+{
+    unsigned long n;
+
+    pthread_mutex_lock(&b->lock);
+    n = d->sent - d->matched - d->superseded;
+    pthread_mutex_unlock(&b->lock);
+    return n;
+}
+
+// Broker thread: every PUBLISH the adapter sends
+static void bench_on_publish(void *pvt, const char *topic, int topic_len, const char *payload, int payload_len, unsigned long long now)
+{
+    struct bench_t *b = pvt;
+    char name[128];
+    char suffix[16];
+    int room, channel, level;
+    int slot;
+
+    if (topic_len >= (int)sizeof(name))
+        return;
+    memcpy(name, topic, topic_len);
+    name[topic_len] = 0;
+
+    if (sscanf(name, "homeassistant/light/rako_%d_%d/%15s", &room, &channel, suffix) != 3)
+        return;
+    slot = bench_slot(b, room, channel);
+    if (slot < 0)
+        return;
+
+    if (strcmp(suffix, "config") == 0) {
+        pthread_mutex_lock(&b->lock);
+        if ((channel > 0) && (b->configs[slot] == 0)) {
+            b->configs[slot] = 1;
+            b->config_count++;
+        }
+        pthread_mutex_unlock(&b->lock);
+    } else if (strcmp(suffix, "state") == 0) {
+        if (fastjson_get_int(payload, payload_len, "brightness", &level) == 0)
+            bench_match(b, &b->events, room, channel, level, now);
+    }
+}
+
+// Hub thread: every send command the adapter writes
+static void bench_on_send(void *pvt, int room, int channel, int level, int scene, unsigned long long now)
+{
+    struct bench_t *b = pvt;
+
+    if ((scene < 0) && (level >= 0))
+        bench_match(b, &b->commands, room, channel, level, now);
+}
+
+static void bench_fire_event(struct bench_t *b)
+{
+    int room = 1 + rand_r(&b->seed) % b->rooms;
+    int channel = 1 + rand_r(&b->seed) % b->channels;
+    int current = hubsim_level(&b->hub, room, channel);
+    int level = (current + 1 + rand_r(&b->seed) % 255) & 0xff;
+
+    bench_expect(b, &b->events, room, channel, level, hubsim_now_us());
+    hubsim_tracker(&b->hub, room, channel, level, 0);
+}
+
+// Brightness 0 means "full" to the adapter, so commands use 1..255
+static void bench_fire_command(struct bench_t *b)
+{
+    int room = 1 + rand_r(&b->seed) % b->rooms;
+    int channel = 1 + rand_r(&b->seed) % b->channels;
+    int last = b->commands.track[bench_slot(b, room, channel)].last;
+    int level = 1 + rand_r(&b->seed) % 255;
+    char topic[64];
+    char payload[64];
+    int len;
+
+    if (level == last)
+        level = (level % 255) + 1;
+
+    snprintf(topic, sizeof(topic), "homeassistant/light/rako_%d_%d/set", room, channel);
+    len = snprintf(payload, sizeof(payload), "{\"state\":\"ON\",\"brightness\":%d}", level);
+
+    bench_expect(b, &b->commands, room, channel, level, hubsim_now_us());
+    mqttsim_publish(&b->broker, topic, payload, len);
+}
+
+static int compare_uint(const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int *)a;
+    unsigned int y = *(const unsigned int *)b;
+
+    return (x > y) - (x < y);
+}
+
+static double percentile(unsigned int *sorted, unsigned long count, double p)
+{
+    unsigned long index;
+
+    if (count == 0)
+        return 0;
+    index = (unsigned long)(p * (count - 1) + 0.5);
+    return sorted[index] / 1000.0;
+}
+
+static void bench_phase(struct bench_t *b, struct bench_dir_t *d, int rate, int seconds, struct bench_result_t *r)
+{
+    unsigned long long start, now, end;
+    unsigned long fired = 0;
+    int a;
+
+    pthread_mutex_lock(&b->lock);
+    for (a = 0; a < bench_slots(b); a++)
+        d->track[a].head = d->track[a].tail;
+    d->count = d->sent = d->matched = d->superseded = 0;
+    b->measuring = d;
+    pthread_mutex_unlock(&b->lock);
+
+    start = hubsim_now_us();
+    end = start + (unsigned long long)seconds * 1000000;
+    while (running && ((now = hubsim_now_us()) < end)) {
+        unsigned long due = (unsigned long)((now - start) * rate / 1000000);
+
+        while (fired < due) {
+            if (d == &b->events)
+                bench_fire_event(b);
+            else
+                bench_fire_command(b);
+            fired++;
+        }
+        usleep(200);
+    }
+
+    r->backlog = bench_outstanding(b, d);
+    end = hubsim_now_us() + BENCH_GRACE_US;
+    while (running && (bench_outstanding(b, d) > 0) && (hubsim_now_us() < end))
+        usleep(1000);
+
+    pthread_mutex_lock(&b->lock);
+    b->measuring = NULL;
+    r->sent = d->sent;
+    r->matched = d->matched;
+    r->superseded = d->superseded;
+    r->lost = d->sent - d->matched - d->superseded;
+    qsort(d->samples, d->count, sizeof(unsigned int), compare_uint);
+    r->p50 = percentile(d->samples, d->count, 0.50);
+    r->p99 = percentile(d->samples, d->count, 0.99);
+    r->p999 = percentile(d->samples, d->count, 0.999);
+    r->max = d->count ? d->samples[d->count - 1] / 1000.0 : 0;
+    pthread_mutex_unlock(&b->lock);
+}
+
+static void print_result(const char *name, int rate, struct bench_result_t *r)
+{
+    printf("%-9s %7d/s  sent %8lu  delivered %8lu  coalesced %6lu  lost %6lu  backlog %6lu  "
+           "p50 %8.3f  p99 %8.3f  p999 %8.3f  max %8.3f ms\n",
+           name, rate, r->sent, r->matched, r->superseded, r->lost, r->backlog,
+           r->p50, r->p99, r->p999, r->max);
+    fflush(stdout);
+}
+
+// Doubles the rate until the adapter falls behind. A step is sustained when the
+// backlog at the end of it is under a quarter second of traffic and nothing is
+// lost once the queues drain.
+static int bench_ramp(struct bench_t *b, struct bench_dir_t *d, int rate, int max_rate, int seconds)
+{
+    struct bench_result_t r;
+    int best = 0;
+
+    for (; running && (rate <= max_rate); rate *= 2) {
+        bench_phase(b, d, rate, seconds, &r);
+        print_result(d->name, rate, &r);
+        if ((r.backlog > (unsigned long)rate / 4 + 10) || (r.lost > r.sent / 100))
+            break;
+        best = rate;
+    }
+    return best;
+}
+
+static pid_t start_adapter(const char *path, int hub_port, int broker_port, const char *window, const char *command_window,
+                           const char *tx_rate, int verbose)
+{
+    char hub[64];
+    char broker[64];
+    pid_t pid;
+
+    snprintf(hub, sizeof(hub), "127.0.0.1:%d", hub_port);
+    snprintf(broker, sizeof(broker), "tcp://127.0.0.1:%d", broker_port);
+
+    pid = fork();
+    if (pid == 0) {
+        if (verbose == 0) {
+            freopen("/dev/null", "w", stdout);
+            freopen("/dev/null", "w", stderr);
+        }
+        execl(path, path, "-r", hub, "-m", broker, "-u", "bench", "-p", "bench",
+              "-w", window, "-c", command_window, "-s", tx_rate, (char *)NULL);
+        perror(path);
+        _exit(127);
+    }
+    return pid;
+}
+
+static int wait_ready(struct bench_t *b, pid_t adapter)
+{
+    char topic[64];
+    int a;
+
+    snprintf(topic, sizeof(topic), "homeassistant/light/rako_%d_%d/set", b->rooms, b->channels);
+    for (a = 0; running && (a < BENCH_READY_SECS * 10); a++) {
+        int configs;
+
+        if ((adapter > 0) && (waitpid(adapter, NULL, WNOHANG) == adapter)) {
+            fprintf(stderr, "Adapter exited during startup\n");
+            return -1;
+        }
+
+        pthread_mutex_lock(&b->lock);
+        configs = b->config_count;
+        pthread_mutex_unlock(&b->lock);
+
+        if ((configs >= b->rooms * b->channels) && (mqttsim_subscribers(&b->broker, topic) > 0) &&
+            (b->hub.queries_rx >= 3)) {
+            usleep(500000);
+            return 0;
+        }
+        usleep(100000);
+    }
+    fprintf(stderr, "Adapter did not finish discovery within %d seconds\n", BENCH_READY_SECS);
+    return -1;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-a adapter] [-x] [-n rooms] [-m channels] [-e events/sec] [-k commands/sec]\n", name);
+    fprintf(stderr, "          [-d seconds] [-R max ramp rate] [-s ramp step seconds] [-w ms] [-c ms] [-S frames/sec] [-P hub port] [-B broker port] [-v]\n");
+    fprintf(stderr, "  -a  adapter binary to launch (default ../Debug/rako_adapter)\n");
+    fprintf(stderr, "  -x  do not launch the adapter, print its command line and wait for it\n");
+    fprintf(stderr, "  -R  0 skips the throughput ramp\n");
+    fprintf(stderr, "  -w -c  coalesce windows handed to the adapter (default 0, measure the pipeline alone)\n");
+    fprintf(stderr, "  -S  hub pacing handed to the adapter as -s (default 0, unpaced; the adapter ships with 20)\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_t *b;
+    struct bench_result_t r;
+    const char *adapter_path = "../Debug/rako_adapter";
+    const char *window = "0";
+    const char *command_window = "0";
+    const char *tx_rate = "0";
+    int external = 0, verbose = 0;
+    int event_rate = 200, command_rate = 200;
+    int seconds = 10, step_seconds = 3, max_rate = 51200;
+    int hub_port = 19762, broker_port = 11883;
+    pid_t adapter = -1;
+    int best_events = 0, best_commands = 0;
+    int opt;
+
+    b = calloc(1, sizeof(struct bench_t));
+    b->rooms = 16;
+    b->channels = 8;
+    b->seed = 1;
+    pthread_mutex_init(&b->lock, NULL);
+
+    while ((opt = getopt(argc, argv, "a:xn:m:e:k:d:R:s:w:c:S:P:B:vh")) != -1) {
+        switch (opt) {
+        case 'a': adapter_path = optarg; break;
+        case 'x': external = 1; break;
+        case 'n': b->rooms = atoi(optarg); break;
+        case 'm': b->channels = atoi(optarg); break;
+        case 'e': event_rate = atoi(optarg); break;
+        case 'k': command_rate = atoi(optarg); break;
+        case 'd': seconds = atoi(optarg); break;
+        case 'R': max_rate = atoi(optarg); break;
+        case 's': step_seconds = atoi(optarg); break;
+        case 'w': window = optarg; break;
+        case 'c': command_window = optarg; break;
+        case 'S': tx_rate = optarg; break;
+        case 'P': hub_port = atoi(optarg); break;
+        case 'B': broker_port = atoi(optarg); break;
+        case 'v': verbose = 1; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // The adapter takes any number of either, channels per room are the simulator's limit
+    if ((b->rooms < 1) || (b->channels < 1) || (b->channels >= HUBSIM_MAX_CHANNELS)) {
+        fprintf(stderr, "Rooms must be at least 1 and channels 1..%d\n", HUBSIM_MAX_CHANNELS - 1);
+        return 1;
+    }
+    b->events.track = calloc(bench_slots(b), sizeof(struct bench_track_t));
+    b->commands.track = calloc(bench_slots(b), sizeof(struct bench_track_t));
+    b->configs = calloc(bench_slots(b), 1);
+
+    b->events.name = "events";
+    b->commands.name = "commands";
+    b->events.samples = malloc(BENCH_MAX_SAMPLES * sizeof(unsigned int));
+    b->commands.samples = malloc(BENCH_MAX_SAMPLES * sizeof(unsigned int));
+
+    signal(SIGINT, stop_handler);
+    signal(SIGTERM, stop_handler);
+    signal(SIGPIPE, SIG_IGN);
+
+    mqttsim_init(&b->broker);
+    b->broker.port = broker_port;
+    b->broker.pvt = b;
+    b->broker.func_publish = bench_on_publish;
+
+    hubsim_init(&b->hub);
+    b->hub.port = hub_port;
+    b->hub.rooms_n = b->rooms;
+    b->hub.channels_n = b->channels;
+    b->hub.fade_ms = 0;
+    b->hub.pvt = b;
+    b->hub.func_send = bench_on_send;
+
+    if ((mqttsim_start(&b->broker) != 0) || (hubsim_start(&b->hub) != 0))
+        return 1;
+
+    if (external) {
+        printf("Start the adapter with: rako_adapter -r 127.0.0.1:%d -m tcp://127.0.0.1:%d -u bench -p bench -w %s -c %s -s %s\n",
+               hub_port, broker_port, window, command_window, tx_rate);
+        fflush(stdout);
+    } else {
+        adapter = start_adapter(adapter_path, hub_port, broker_port, window, command_window, tx_rate, verbose);
+        if (adapter < 0)
+            return 1;
+    }
+
+    if (wait_ready(b, adapter) == 0) {
+        printf("%d rooms x %d channels, coalesce -w %s -c %s, hub pacing -s %s\n", b->rooms, b->channels, window, command_window, tx_rate);
+        if (atoi(tx_rate) > 0)
+            printf("commands are throttled to %s frames/s by the adapter, rates above that measure the pacing\n", tx_rate);
+
+        bench_phase(b, &b->events, event_rate, seconds, &r);
+        print_result("events", event_rate, &r);
+        bench_phase(b, &b->commands, command_rate, seconds, &r);
+        print_result("commands", command_rate, &r);
+
+        if (max_rate > 0) {
+            best_events = bench_ramp(b, &b->events, 100, max_rate, step_seconds);
+            best_commands = bench_ramp(b, &b->commands, 100, max_rate, step_seconds);
+            printf("max sustained: events %d/s, commands %d/s\n", best_events, best_commands);
+        }
+
+        hubsim_report(&b->hub, stdout);
+        printf("broker: connections=%lu publishes_rx=%lu publishes_tx=%lu\n",
+               b->broker.connections, b->broker.publishes_rx, b->broker.publishes_tx);
+    }
+
+    if (adapter > 0) {
+        kill(adapter, SIGTERM);
+        waitpid(adapter, NULL, 0);
+    }
+    return 0;
+}
@@ -0,0 +1,663 @@
+#include "hubsim.h"
+#include "fastjson.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+
+struct hubsim_sample_channel_t {
+    int id;
+    const char *title;
+    int scene_levels[HUBSIM_SCENES];
+};
+
+struct hubsim_sample_room_t {
+    int id;
+    const char *title;
+    const char *type;
+    int first_channel;      // Index into sample_channels
+    int channel_count;
+};
+
+// The house captured in the trailing comment of main.c
+static const struct hubsim_sample_channel_t sample_channels[] = {
+    { 1, "Channel 1", { 0, 255, 191, 127, 63, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 2, "test", { 0, 255, 191, 127, 63, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 1, "Channel 1", { 0, 255, 191, 127, 63, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 2, "Dining room pendants", { 0, 255, 191, 255, 64, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 3, "dining downlights", { 0, 255, 191, 0, 64, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 1, "Kitchen Pendants", { 0, 129, 121, 128, 64, 255, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 2, "Spot lights", { 0, 181, 191, 0, 0, 255, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 3, "Ceiling spots", { 0, 181, 191, 0, 0, 255, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 4, "Air con area downlights", { 0, 181, 191, 127, 64, 255, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 5, "Cill uplights", { 0, 181, 191, 127, 64, 255, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 6, "Floor uplights", { 0, 181, 191, 127, 64, 255, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 7, "Spare", { 0, 181, 191, 127, 124, 255, 158, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 8, "Spare", { 0, 181, 191, 127, 64, 255, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 1, "Channel 1", { 0, 255, 191, 127, 63, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 1, "Spots", { 0, 255, 191, 127, 63, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 1, "Downlights", { 0, 0, 64, 144, 194, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 2, "Chandelier", { 0, 0, 191, 134, 134, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 3, "Alcove lights", { 0, 0, 191, 255, 255, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 4, "Bath up lights", { 0, 255, 191, 255, 255, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 5, "Fan + mirror demister", { 0, 0, 191, 255, 191, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 2, "Downlights", { 0, 255, 191, 127, 63, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 1, "Downlights", { 0, 0, 191, 127, 63, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 2, "Wall lights left", { 0, 0, 191, 127, 63, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 3, "Wall lights right", { 0, 0, 191, 127, 63, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 1, "downlights sitting area", { 0, 255, 191, 127, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 2, "Down lights bed area", { 0, 255, 191, 127, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 3, "Chandeliers", { 0, 255, 191, 127, 220, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 4, "Wall light 1", { 0, 255, 191, 127, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 5, "Wall light 2", { 0, 255, 191, 127, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 6, "Wall light 3", { 0, 255, 191, 127, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 7, "Wall light 4", { 0, 255, 191, 127, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 2, "Downlights", { 0, 255, 191, 127, 64, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 5, "LED strip sink", { 0, 255, 191, 127, 64, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 6, "Alcove lights", { 0, 255, 191, 127, 64, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 7, "Window cill uplights", { 0, 255, 191, 127, 64, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 8, "Fan", { 0, 255, 191, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 1, "Downlights", { 0, 255, 191, 127, 63, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 2, "Downlights", { 0, 255, 191, 127, 63, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 1, "Channel 1", { 0, 255, 117, 83, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 1, "Seating Area", { 0, 135, 0, 0, 64, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 2, "Perimeter Downlights", { 0, 135, 140, 40, 64, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 3, "Floor Uplighters", { 0, 135, 191, 127, 64, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 1, "1", { 0, 255, 191, 127, 63, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+};
+
+static const struct hubsim_sample_room_t sample_rooms[] = {
+    { 0, "House Master", "LIGHT", 0, 0 },
+    { 1, "Hallway", "LIGHT", 0, 2 },
+    { 3, "plant room", "LIGHT", 2, 1 },
+    { 5, "dining", "LIGHT", 3, 2 },
+    { 6, "kitchen", "LIGHT", 5, 8 },
+    { 7, "pantry", "LIGHT", 13, 0 },
+    { 17, "boiler room", "LIGHT", 13, 1 },
+    { 10, "upstairs hallway", "LIGHT", 14, 1 },
+    { 11, "Bernies Bathroom", "LIGHT", 15, 5 },
+    { 12, "Bernies dressing", "LIGHT", 20, 1 },
+    { 13, "roger Dressing", "LIGHT", 21, 3 },
+    { 14, "master bed", "LIGHT", 24, 7 },
+    { 15, "rogers bathroom", "LIGHT", 31, 5 },
+    { 16, "gym", "LIGHT", 36, 2 },
+    { 2, "downstairs bathroom", "LIGHT", 38, 1 },
+    { 21, "Lounge", "LIGHT", 39, 3 },
+    { 19, "outside lights", "LIGHT", 42, 1 },
+    { 25, "Upstairs", "SWITCH", 43, 0 },
+    { 26, "Downstairs", "SWITCH", 43, 0 },
+};
+
+#define SAMPLE_ROOMS (int)(sizeof(sample_rooms) / sizeof(sample_rooms[0]))
+
+
+// Growable output buffer for building replies
+struct hubsim_buf_t {
+    char *data;
+    int len;
+    int size;
+};
+
+static void buf_printf(struct hubsim_buf_t *b, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    while (1) {
+        va_start(ap, fmt);
+        n = vsnprintf(b->data + b->len, b->size - b->len, fmt, ap);
+        va_end(ap);
+        if (n < b->size - b->len)
+            break;
+        b->size = (b->size + n) * 2;
+        b->data = realloc(b->data, b->size);
+    }
+    b->len += n;
+}
+
+unsigned long long hubsim_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void hubsim_init(struct hubsim_t *h)
+{
+    memset(h, 0, sizeof(struct hubsim_t));
+    h->port = HUBSIM_PORT;
+    h->channels_n = 8;
+    h->feedback_pct = 10;
+    h->fade_ms = 1000;
+    h->echo = 1;
+    h->listen_fd = -1;
+    h->client_fd = -1;
+    h->seed = 1;
+    strcpy(h->hub_id, "12345cad-254f-0000-beef-4d63deadbeef");
+    pthread_mutex_init(&h->lock, NULL);
+}
+
+static void hubsim_build(struct hubsim_t *h)
+{
+    int a, b;
+
+    if (h->rooms_n <= 0) {
+        h->room_count = SAMPLE_ROOMS;
+        h->rooms = calloc(h->room_count, sizeof(struct hubsim_room_t));
+        for (a = 0; a < SAMPLE_ROOMS; a++) {
+            struct hubsim_room_t *r = &h->rooms[a];
+
+            r->id = sample_rooms[a].id;
+            snprintf(r->title, sizeof(r->title), "%s", sample_rooms[a].title);
+            snprintf(r->type, sizeof(r->type), "%s", sample_rooms[a].type);
+            r->channel_count = sample_rooms[a].channel_count;
+            for (b = 0; b < r->channel_count; b++) {
+                const struct hubsim_sample_channel_t *c = &sample_channels[sample_rooms[a].first_channel + b];
+
+                r->channels[b].id = c->id;
+                snprintf(r->channels[b].title, sizeof(r->channels[b].title), "%s", c->title);
+                memcpy(r->channels[b].scene_levels, c->scene_levels, sizeof(c->scene_levels));
+            }
+        }
+        return;
+    }
+
+    // Room 0 is the house master on a real hub, generated rooms start at 1
+    if (h->channels_n > HUBSIM_MAX_CHANNELS - 1)
+        h->channels_n = HUBSIM_MAX_CHANNELS - 1;
+    h->room_count = h->rooms_n;
+    h->rooms = calloc(h->room_count, sizeof(struct hubsim_room_t));
+    for (a = 0; a < h->room_count; a++) {
+        struct hubsim_room_t *r = &h->rooms[a];
+
+        r->id = a + 1;
+        snprintf(r->title, sizeof(r->title), "room %d", a + 1);
+        snprintf(r->type, sizeof(r->type), "LIGHT");
+        r->channel_count = h->channels_n;
+        for (b = 0; b < r->channel_count; b++) {
+            r->channels[b].id = b + 1;
+            snprintf(r->channels[b].title, sizeof(r->channels[b].title), "channel %d", b + 1);
+            r->channels[b].scene_levels[1] = 255;
+            r->channels[b].scene_levels[2] = 191;
+            r->channels[b].scene_levels[3] = 127;
+            r->channels[b].scene_levels[4] = 63;
+        }
+    }
+}
+
+static struct hubsim_room_t *hubsim_room(struct hubsim_t *h, int id)
+{
+    int a;
+
+    for (a = 0; a < h->room_count; a++) {
+        if (h->rooms[a].id == id)
+            return &h->rooms[a];
+    }
+    return NULL;
+}
+
+static struct hubsim_channel_t *hubsim_channel(struct hubsim_room_t *r, int id)
+{
+    int a;
+
+    for (a = 0; a < r->channel_count; a++) {
+        if (r->channels[a].id == id)
+            return &r->channels[a];
+    }
+    return NULL;
+}
+
+// Caller holds h->lock. Frames are CR/LF terminated like the hub's own.
+// A failed send only marks the connection, the simulator thread may be in
+// recv on it and is the one that closes it.
+static int hubsim_send(struct hubsim_t *h, const char *data, int len)
+{
+    while ((len > 0) && (h->client_fd >= 0) && !h->client_failed) {
+        ssize_t rc = send(h->client_fd, data, len, MSG_NOSIGNAL);
+
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            h->client_failed = 1;
+            shutdown(h->client_fd, SHUT_RDWR);
+            return -1;
+        }
+        data += rc;
+        len -= rc;
+    }
+    return ((h->client_fd >= 0) && !h->client_failed) ? 0 : -1;
+}
+
+static void hubsim_reply_status(struct hubsim_t *h, struct hubsim_buf_t *b)
+{
+    buf_printf(b, "{\"name\":\"status\",\"payload\":{\"productType\":\"Hub\",\"protocolVersion\":2,"
+               "\"hubId\":\"%s\",\"mac;\":\"70:B3:D5:00:00:00\",\"hubVersion\":\"3.1.6\"}}\r\n", h->hub_id);
+}
+
+static void hubsim_reply_rooms(struct hubsim_t *h, struct hubsim_buf_t *b)
+{
+    int a;
+
+    buf_printf(b, "{\"name\":\"query_ROOM\",\"payload\":[");
+    for (a = 0; a < h->room_count; a++) {
+        buf_printf(b, "%s{\"roomId\":%d,\"title\":\"%s\",\"type\":\"%s\"}", a ? "," : "",
+                   h->rooms[a].id, h->rooms[a].title, h->rooms[a].type);
+    }
+    buf_printf(b, "]}\r\n");
+}
+
+static void hubsim_reply_channels(struct hubsim_t *h, struct hubsim_buf_t *b)
+{
+    int a, c, s;
+
+    buf_printf(b, "{\"name\":\"query_CHANNEL\",\"payload\":[");
+    for (a = 0; a < h->room_count; a++) {
+        struct hubsim_room_t *r = &h->rooms[a];
+
+        buf_printf(b, "%s{\"roomId\":%d,\"title\":\"%s\",\"type\":\"%s\",\"channel\":[", a ? "," : "",
+                   r->id, r->title, r->type);
+        for (c = 0; c < r->channel_count; c++) {
+            buf_printf(b, "%s{\"channelId\":%d,\"title\":\"%s\",\"type\":\"SLIDER\",\"sceneLevels\":[", c ? "," : "",
+                       r->channels[c].id, r->channels[c].title);
+            for (s = 0; s < HUBSIM_SCENES; s++)
+                buf_printf(b, "%s%d", s ? "," : "", r->channels[c].scene_levels[s]);
+            buf_printf(b, "]}");
+        }
+        buf_printf(b, "]}");
+    }
+    buf_printf(b, "]}\r\n");
+}
+
+// room 0 answers for the whole house
+static void hubsim_reply_levels(struct hubsim_t *h, struct hubsim_buf_t *b, int room)
+{
+    int a, c, n = 0;
+
+    buf_printf(b, "{\"name\":\"query_LEVEL\",\"payload\":[");
+    for (a = 0; a < h->room_count; a++) {
+        struct hubsim_room_t *r = &h->rooms[a];
+
+        if ((room != 0) && (r->id != room))
+            continue;
+        buf_printf(b, "%s{\"roomId\":%d,\"currentScene\":%d,\"channel\":[", n++ ? "," : "", r->id, r->scene);
+        for (c = 0; c < r->channel_count; c++) {
+            buf_printf(b, "%s{\"channelId\":%d,\"currentLevel\":%d,\"targetLevel\":null}", c ? "," : "",
+                       r->channels[c].id, r->channels[c].level);
+        }
+        buf_printf(b, "]}");
+    }
+    buf_printf(b, "]}\r\n");
+}
+
+// Caller holds h->lock
+static void hubsim_tracker_locked(struct hubsim_t *h, struct hubsim_buf_t *b, struct hubsim_room_t *r, struct hubsim_channel_t *c, int level, int time_to_take)
+{
+    buf_printf(b, "{\"name\":\"tracker\",\"type\":\"level\",\"payload\":{\"roomId\":%d,\"channelId\":%d,"
+               "\"currentLevel\":%d,\"targetLevel\":%d,\"timeToTake\":%d,\"temporary\":false}}\r\n",
+               r->id, c->id, c->level, level, time_to_take);
+    c->level = level;
+    h->events_tx++;
+}
+
+static void hubsim_feedback_locked(struct hubsim_t *h, struct hubsim_buf_t *b, struct hubsim_room_t *r, int scene)
+{
+    int c;
+
+    if ((scene < 0) || (scene >= HUBSIM_SCENES))
+        return;
+
+    buf_printf(b, "{\"name\":\"feedback\",\"payload\":{\"action\":{\"actUniqueId\":-1,\"defaultFadeRate\":true,\"decay\":0,"
+               "\"expFadeRate\":false,\"scene\":%d,\"command\":49},\"room\":%d,\"channel\":0,"
+               "\"description\":\"[Rm:%d %s] Scene %d\"}}\r\n", scene, r->id, r->id, r->title, scene);
+    r->scene = scene;
+    h->events_tx++;
+
+    for (c = 0; c < r->channel_count; c++)
+        hubsim_tracker_locked(h, b, r, &r->channels[c], r->channels[c].scene_levels[scene], h->fade_ms);
+}
+
+int hubsim_tracker(struct hubsim_t *h, int room, int channel, int level, int time_to_take)
+{
+    struct hubsim_buf_t b = { NULL, 0, 0 };
+    struct hubsim_room_t *r;
+    struct hubsim_channel_t *c;
+    int rc = -1;
+
+    pthread_mutex_lock(&h->lock);
+    r = hubsim_room(h, room);
+    c = (r != NULL) ? hubsim_channel(r, channel) : NULL;
+    if (c != NULL) {
+        hubsim_tracker_locked(h, &b, r, c, level, time_to_take);
+        rc = hubsim_send(h, b.data, b.len);
+    }
+    pthread_mutex_unlock(&h->lock);
+    free(b.data);
+    return rc;
+}
+
+int hubsim_feedback(struct hubsim_t *h, int room, int scene)
+{
+    struct hubsim_buf_t b = { NULL, 0, 0 };
+    struct hubsim_room_t *r;
+    int rc = -1;
+
+    pthread_mutex_lock(&h->lock);
+    r = hubsim_room(h, room);
+    if (r != NULL) {
+        hubsim_feedback_locked(h, &b, r, scene);
+        rc = hubsim_send(h, b.data, b.len);
+    }
+    pthread_mutex_unlock(&h->lock);
+    free(b.data);
+    return rc;
+}
+
+int hubsim_connected(struct hubsim_t *h)
+{
+    int rc;
+
+    pthread_mutex_lock(&h->lock);
+    rc = (h->client_fd >= 0) && !h->client_failed;
+    pthread_mutex_unlock(&h->lock);
+    return rc;
+}
+
+// Level the model currently holds for a channel, -1 if there is no such channel
+int hubsim_level(struct hubsim_t *h, int room, int channel)
+{
+    struct hubsim_room_t *r;
+    struct hubsim_channel_t *c;
+    int level = -1;
+
+    pthread_mutex_lock(&h->lock);
+    r = hubsim_room(h, room);
+    c = (r != NULL) ? hubsim_channel(r, channel) : NULL;
+    if (c != NULL)
+        level = c->level;
+    pthread_mutex_unlock(&h->lock);
+    return level;
+}
+
+static void hubsim_log_send(struct hubsim_t *h, const char *line, int len)
+{
+    unsigned long long t = hubsim_now_us() - h->start_us;
+
+    if (h->log == NULL)
+        return;
+    fprintf(h->log, "[%6llu.%06llu] %.*s\n", t / 1000000, t % 1000000, len, line);
+    fflush(h->log);
+}
+
+// {"name": "send","payload": {"room": 1,"channel": 2,"action": {"command": "levelrate","level": 128}}}
+static void hubsim_handle_send(struct hubsim_t *h, struct hubsim_buf_t *b, const char *line, int len)
+{
+    unsigned long long now = hubsim_now_us();
+    struct hubsim_room_t *r;
+    int room, channel, level = -1, scene = -1;
+
+    h->sends_rx++;
+    hubsim_log_send(h, line, len);
+
+    if ((fastjson_get_int(line, len, "room", &room) < 0) || (fastjson_get_int(line, len, "channel", &channel) < 0))
+        return;
+    if (fastjson_string_equals(line, len, "command", "scene") == 0)
+        fastjson_get_int(line, len, "scene", &scene);
+    else
+        fastjson_get_int(line, len, "level", &level);
+
+    if (h->func_send != NULL)
+        h->func_send(h->pvt, room, channel, level, scene, now);
+
+    if (h->echo == 0)
+        return;
+
+    // Room 0, channel 0 is the whole house
+    if ((room == 0) && (channel == 0) && (level >= 0)) {
+        int a, c;
+
+        for (a = 0; a < h->room_count; a++) {
+            for (c = 0; c < h->rooms[a].channel_count; c++)
+                hubsim_tracker_locked(h, b, &h->rooms[a], &h->rooms[a].channels[c], level, h->fade_ms);
+        }
+        return;
+    }
+
+    r = hubsim_room(h, room);
+    if (r == NULL)
+        return;
+
+    if (scene >= 0) {
+        hubsim_feedback_locked(h, b, r, scene);
+    } else if (level >= 0) {
+        int a;
+
+        // Channel 0 addresses every channel of the room
+        for (a = 0; a < r->channel_count; a++) {
+            if ((channel == 0) || (r->channels[a].id == channel))
+                hubsim_tracker_locked(h, b, r, &r->channels[a], level, h->fade_ms);
+        }
+    }
+}
+
+static void hubsim_handle_line(struct hubsim_t *h, struct hubsim_buf_t *b, const char *line, int len)
+{
+    const char *type;
+    int type_len;
+    int room;
+
+    if ((len >= 4) && (memcmp(line, "SUB,", 4) == 0)) {
+        if (h->log != NULL)
+            fprintf(h->log, "Client subscribed: %.*s\n", len, line);
+        return;
+    }
+    if ((len < 2) || (line[0] != '{'))
+        return;
+
+    h->frames_rx++;
+    if (fastjson_string_equals(line, len, "name", "status") == 0) {
+        if (h->status_late && !h->channel_answered)
+            h->status_held = 1;
+        else
+            hubsim_reply_status(h, b);
+    } else if (fastjson_string_equals(line, len, "name", "send") == 0) {
+        hubsim_handle_send(h, b, line, len);
+    } else if ((fastjson_string_equals(line, len, "name", "query") == 0) &&
+               (fastjson_get_string(line, len, "queryType", &type, &type_len) == 0)) {
+        h->queries_rx++;
+        if ((type_len == 4) && (memcmp(type, "ROOM", 4) == 0))
+            hubsim_reply_rooms(h, b);
+        else if ((type_len == 7) && (memcmp(type, "CHANNEL", 7) == 0)) {
+            hubsim_reply_channels(h, b);
+            h->channel_answered = 1;
+            if (h->status_held) {
+                h->status_held = 0;
+                hubsim_reply_status(h, b);
+            }
+        }
+        else if ((type_len == 5) && (memcmp(type, "LEVEL", 5) == 0))
+            hubsim_reply_levels(h, b, (fastjson_get_int(line, len, "roomId", &room) == 0) ? room : 0);
+    }
+}
+
+// Splits the receive buffer on CR, LF and the NULs the adapter appends to its frames
+static void hubsim_process(struct hubsim_t *h)
+{
+    struct hubsim_buf_t b = { NULL, 0, 0 };
+    int start = 0;
+    int a;
+
+    pthread_mutex_lock(&h->lock);
+    for (a = 0; a < h->rx_len; a++) {
+        char ch = h->rx[a];
+
+        if ((ch == 0x0d) || (ch == 0x0a) || (ch == 0)) {
+            if (a > start)
+                hubsim_handle_line(h, &b, h->rx + start, a - start);
+            start = a + 1;
+        }
+    }
+    memmove(h->rx, h->rx + start, h->rx_len - start);
+    h->rx_len -= start;
+    if (h->rx_len == HUBSIM_RX_BUFFER)
+        h->rx_len = 0;      // A line longer than the buffer, drop it
+
+    if (b.len > 0)
+        hubsim_send(h, b.data, b.len);
+    pthread_mutex_unlock(&h->lock);
+    free(b.data);
+}
+
+static void hubsim_storm(struct hubsim_t *h)
+{
+    struct hubsim_buf_t b = { NULL, 0, 0 };
+    unsigned long long now = hubsim_now_us();
+    unsigned long long period = 1000000ULL / h->event_rate;
+
+    pthread_mutex_lock(&h->lock);
+    while (h->next_event_us <= now) {
+        struct hubsim_room_t *r = &h->rooms[rand_r(&h->seed) % h->room_count];
+
+        h->next_event_us += period;
+        if (r->channel_count == 0)
+            continue;
+        if ((int)(rand_r(&h->seed) % 100) < h->feedback_pct) {
+            hubsim_feedback_locked(h, &b, r, rand_r(&h->seed) % 5);
+        } else {
+            struct hubsim_channel_t *c = &r->channels[rand_r(&h->seed) % r->channel_count];
+
+            hubsim_tracker_locked(h, &b, r, c, rand_r(&h->seed) % 256, h->fade_ms);
+        }
+    }
+    if (b.len > 0)
+        hubsim_send(h, b.data, b.len);
+    pthread_mutex_unlock(&h->lock);
+    free(b.data);
+}
+
+static void *hubsim_thread(void *paramPtr)
+{
+    struct hubsim_t *h = paramPtr;
+
+    while (1) {
+        struct pollfd fds[2];
+        int timeout = -1;
+        int nfds = 1;
+        int client;
+
+        // Senders on other threads only flag a failed connection, it is
+        // closed here so the fd cannot be reused while this thread uses it
+        pthread_mutex_lock(&h->lock);
+        if (h->client_failed) {
+            close(h->client_fd);
+            h->client_fd = -1;
+            h->client_failed = 0;
+        }
+        client = h->client_fd;
+        pthread_mutex_unlock(&h->lock);
+
+        fds[0].fd = h->listen_fd;
+        fds[0].events = POLLIN;
+        if (client >= 0) {
+            fds[1].fd = client;
+            fds[1].events = POLLIN;
+            nfds = 2;
+
+            if (h->event_rate > 0) {
+                unsigned long long now = hubsim_now_us();
+
+                timeout = (h->next_event_us > now) ? (int)((h->next_event_us - now + 999) / 1000) : 0;
+            }
+        }
+
+        if (poll(fds, nfds, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            return NULL;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(h->listen_fd, NULL, NULL);
+            int one = 1;
+
+            if (fd >= 0) {
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                pthread_mutex_lock(&h->lock);
+                if (h->client_fd >= 0)
+                    close(h->client_fd);
+                h->client_fd = fd;
+                h->client_failed = 0;
+                h->status_held = 0;
+                h->channel_answered = 0;
+                h->rx_len = 0;
+                h->connections++;
+                h->next_event_us = hubsim_now_us();
+                pthread_mutex_unlock(&h->lock);
+            }
+            continue;
+        }
+
+        if ((nfds == 2) && (fds[1].revents & (POLLIN | POLLHUP | POLLERR))) {
+            ssize_t rc = recv(client, h->rx + h->rx_len, HUBSIM_RX_BUFFER - h->rx_len, 0);
+
+            if (rc <= 0) {
+                pthread_mutex_lock(&h->lock);
+                close(client);
+                h->client_fd = -1;
+                h->client_failed = 0;
+                pthread_mutex_unlock(&h->lock);
+                continue;
+            }
+            h->rx_len += rc;
+            hubsim_process(h);
+        }
+
+        if ((client >= 0) && (h->event_rate > 0))
+            hubsim_storm(h);
+    }
+    return NULL;
+}
+
+int hubsim_start(struct hubsim_t *h)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+
+    hubsim_build(h);
+    h->start_us = hubsim_now_us();
+
+    h->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (h->listen_fd < 0)
+        return -1;
+    setsockopt(h->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(h->port);
+    if ((bind(h->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) || (listen(h->listen_fd, 1) < 0)) {
+        perror("hubsim bind");
+        close(h->listen_fd);
+        h->listen_fd = -1;
+        return -1;
+    }
+
+    return pthread_create(&h->thread, NULL, hubsim_thread, h);
+}
+
+void hubsim_report(struct hubsim_t *h, FILE *out)
+{
+    pthread_mutex_lock(&h->lock);
+    fprintf(out, "connections=%lu frames_rx=%lu queries_rx=%lu sends_rx=%lu events_tx=%lu\n",
+            h->connections, h->frames_rx, h->queries_rx, h->sends_rx, h->events_tx);
+    pthread_mutex_unlock(&h->lock);
+}
@@ -0,0 +1,84 @@
+#ifndef HUBSIM_H
+#define HUBSIM_H
+
+#include <pthread.h>
+#include <stdio.h>
+
+// Stand-in for a RAKO hub, speaks enough of the JSON protocol on port 9762
+// for the adapter to discover a house, take commands and receive events.
+
+#define HUBSIM_PORT         9762
+#define HUBSIM_MAX_CHANNELS 16
+#define HUBSIM_SCENES       17
+#define HUBSIM_RX_BUFFER    65536
+
+struct hubsim_channel_t {
+    int id;
+    char title[48];
+    int scene_levels[HUBSIM_SCENES];
+    int level;
+};
+
+struct hubsim_room_t {
+    int id;
+    char title[48];
+    char type[16];
+    int scene;
+    int channel_count;
+    struct hubsim_channel_t channels[HUBSIM_MAX_CHANNELS];
+};
+
+struct hubsim_t {
+    // Configuration, set before hubsim_start()
+    int port;
+    int rooms_n;            // Generated rooms, 0 serves the sample house from main.c
+    int channels_n;         // Channels per generated room
+    int event_rate;         // Unsolicited events per second, 0 for none
+    int feedback_pct;       // Share of those events that are scene feedback
+    int fade_ms;            // timeToTake reported in tracker events
+    int echo;               // Answer send commands with tracker/feedback like a real hub
+    int status_late;        // Hold a connection's first status reply until CHANNEL has been answered
+    char hub_id[48];        // Reported in the status reply, names the topics when the adapter has several hubs
+    FILE *log;              // Timestamped log of received send commands, NULL for none
+
+    // Optional hook, called on the simulator thread for every send command
+    void *pvt;
+    void (*func_send)(void *pvt, int room, int channel, int level, int scene, unsigned long long now_us);
+
+    // House model
+    int room_count;
+    struct hubsim_room_t *rooms;
+
+    // Connection
+    int listen_fd;
+    int client_fd;          // Closed and replaced only on the simulator thread
+    int client_failed;      // A send failed, the simulator thread closes client_fd
+    int status_held;        // status_late, a status query is waiting for the CHANNEL answer
+    int channel_answered;   // status_late, CHANNEL has been answered on this connection
+    char rx[HUBSIM_RX_BUFFER];
+    int rx_len;
+    pthread_mutex_t lock;   // Guards client_fd writes and the model
+    pthread_t thread;
+    unsigned long long start_us;
+    unsigned long long next_event_us;
+    unsigned int seed;
+
+    // Counters
+    unsigned long connections;
+    unsigned long frames_rx;
+    unsigned long queries_rx;
+    unsigned long sends_rx;
+    unsigned long events_tx;
+};
+
+unsigned long long hubsim_now_us(void);
+
+void hubsim_init(struct hubsim_t *h);
+int hubsim_start(struct hubsim_t *h);
+int hubsim_connected(struct hubsim_t *h);
+int hubsim_level(struct hubsim_t *h, int room, int channel);
+int hubsim_tracker(struct hubsim_t *h, int room, int channel, int level, int time_to_take);
+int hubsim_feedback(struct hubsim_t *h, int room, int scene);
+void hubsim_report(struct hubsim_t *h, FILE *out);
+
+#endif
@@ -0,0 +1,80 @@
+#include "hubsim.h"
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+static volatile int running = 1;
+
+static void stop_handler(int sig)
+{
+    running = 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-p port] [-n rooms] [-m channels] [-e events/sec] [-f feedback%%] [-t fade_ms] [-d seconds] [-q]\r\n", name);
+    fprintf(stderr, "  -n 0 (default) serves the sample house, -q stops echoing sends as tracker events\r\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct hubsim_t *h;
+    int duration = 0;
+    int opt;
+
+    h = malloc(sizeof(struct hubsim_t));
+    hubsim_init(h);
+    h->log = stdout;
+
+    while ((opt = getopt(argc, argv, "p:n:m:e:f:t:d:qh")) != -1) {
+        switch (opt) {
+        case 'p':
+            h->port = atoi(optarg);
+            break;
+        case 'n':
+            h->rooms_n = atoi(optarg);
+            break;
+        case 'm':
+            h->channels_n = atoi(optarg);
+            break;
+        case 'e':
+            h->event_rate = atoi(optarg);
+            break;
+        case 'f':
+            h->feedback_pct = atoi(optarg);
+            break;
+        case 't':
+            h->fade_ms = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'q':
+            h->echo = 0;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    signal(SIGINT, stop_handler);
+    signal(SIGTERM, stop_handler);
+
+    if (hubsim_start(h) != 0) {
+        fprintf(stderr, "Unable to listen on port %d\r\n", h->port);
+        return 1;
+    }
+    printf("Simulated hub on port %d, %d rooms, %d events/sec\r\n", h->port, h->room_count, h->event_rate);
+
+    while (running) {
+        sleep(1);
+        if ((duration > 0) && (--duration == 0))
+            break;
+    }
+
+    hubsim_report(h, stdout);
+    return 0;
+}
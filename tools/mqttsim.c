@@ -0,0 +1,383 @@
+#include "mqttsim.h"
+#include "hubsim.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+void mqttsim_init(struct mqttsim_t *m)
+{
+    int a;
+
+    memset(m, 0, sizeof(struct mqttsim_t));
+    m->port = MQTTSIM_PORT;
+    m->listen_fd = -1;
+    for (a = 0; a < MQTTSIM_MAX_CLIENTS; a++)
+        m->clients[a].fd = -1;
+    pthread_mutex_init(&m->lock, NULL);
+}
+
+// + matches one level, # matches the rest of the topic
+int mqttsim_topic_matches(const char *filter, const char *topic, int topic_len)
+{
+    int t = 0;
+
+    while (*filter) {
+        if (*filter == '#')
+            return 1;
+        if (*filter == '+') {
+            while ((t < topic_len) && (topic[t] != '/'))
+                t++;
+            filter++;
+            continue;
+        }
+        if ((t >= topic_len) || (*filter != topic[t]))
+            return 0;
+        filter++;
+        t++;
+    }
+    return t == topic_len;
+}
+
+// Caller holds m->lock
+static int mqttsim_write(struct mqttsim_client_t *c, const unsigned char *data, int len)
+{
+    while ((len > 0) && (c->fd >= 0)) {
+        ssize_t rc = send(c->fd, data, len, MSG_NOSIGNAL);
+
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += rc;
+        len -= rc;
+    }
+    return 0;
+}
+
+static void mqttsim_drop(struct mqttsim_t *m, struct mqttsim_client_t *c)
+{
+    pthread_mutex_lock(&m->lock);
+    if (c->fd >= 0)
+        close(c->fd);
+    c->fd = -1;
+    c->filter_count = 0;
+    c->rx_len = 0;
+    pthread_mutex_unlock(&m->lock);
+}
+
+static int mqttsim_encode_length(unsigned char *out, int len)
+{
+    int n = 0;
+
+    do {
+        out[n] = len & 0x7f;
+        len >>= 7;
+        if (len > 0)
+            out[n] |= 0x80;
+        n++;
+    } while (len > 0);
+    return n;
+}
+
+int mqttsim_publish(struct mqttsim_t *m, const char *topic, const char *payload, int payload_len)
+{
+    int topic_len = strlen(topic);
+    int body = 2 + topic_len + payload_len;
+    unsigned char *pkt = malloc(body + 5);
+    int delivered = 0;
+    int n = 0;
+    int a, b;
+
+    pkt[n++] = 0x30;
+    n += mqttsim_encode_length(pkt + n, body);
+    pkt[n++] = topic_len >> 8;
+    pkt[n++] = topic_len & 0xff;
+    memcpy(pkt + n, topic, topic_len);
+    n += topic_len;
+    memcpy(pkt + n, payload, payload_len);
+    n += payload_len;
+
+    pthread_mutex_lock(&m->lock);
+    for (a = 0; a < MQTTSIM_MAX_CLIENTS; a++) {
+        struct mqttsim_client_t *c = &m->clients[a];
+
+        for (b = 0; (c->fd >= 0) && (b < c->filter_count); b++) {
+            if (mqttsim_topic_matches(c->filters[b], topic, topic_len)) {
+                if (mqttsim_write(c, pkt, n) == 0)
+                    delivered++;
+                break;
+            }
+        }
+    }
+    m->publishes_tx += delivered;
+    pthread_mutex_unlock(&m->lock);
+
+    free(pkt);
+    return delivered;
+}
+
+int mqttsim_subscribers(struct mqttsim_t *m, const char *topic)
+{
+    int count = 0;
+    int a, b;
+
+    pthread_mutex_lock(&m->lock);
+    for (a = 0; a < MQTTSIM_MAX_CLIENTS; a++) {
+        for (b = 0; (m->clients[a].fd >= 0) && (b < m->clients[a].filter_count); b++) {
+            if (mqttsim_topic_matches(m->clients[a].filters[b], topic, strlen(topic))) {
+                count++;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&m->lock);
+    return count;
+}
+
+static void mqttsim_ack(struct mqttsim_t *m, struct mqttsim_client_t *c, unsigned char type, const unsigned char *id)
+{
+    unsigned char ack[4] = { type, 2, id[0], id[1] };
+
+    pthread_mutex_lock(&m->lock);
+    mqttsim_write(c, ack, sizeof(ack));
+    pthread_mutex_unlock(&m->lock);
+}
+
+static void mqttsim_subscribe(struct mqttsim_t *m, struct mqttsim_client_t *c, const unsigned char *p, int len)
+{
+    unsigned char reply[MQTTSIM_MAX_FILTERS + 4];
+    int granted = 0;
+    int pos = 2;
+
+    pthread_mutex_lock(&m->lock);
+    while ((pos + 3 <= len) && (granted < MQTTSIM_MAX_FILTERS)) {
+        int flen = (p[pos] << 8) | p[pos + 1];
+
+        if (pos + 2 + flen + 1 > len)
+            break;
+        if ((c->filter_count < MQTTSIM_MAX_FILTERS) && (flen < (int)sizeof(c->filters[0]))) {
+            memcpy(c->filters[c->filter_count], p + pos + 2, flen);
+            c->filters[c->filter_count][flen] = 0;
+            c->filter_count++;
+        }
+        reply[4 + granted++] = 0;
+        pos += 2 + flen + 1;
+    }
+    reply[0] = 0x90;
+    reply[1] = 2 + granted;
+    reply[2] = p[0];
+    reply[3] = p[1];
+    mqttsim_write(c, reply, 4 + granted);
+    pthread_mutex_unlock(&m->lock);
+}
+
+static void mqttsim_unsubscribe(struct mqttsim_t *m, struct mqttsim_client_t *c, const unsigned char *p, int len)
+{
+    int pos = 2;
+    int a;
+
+    pthread_mutex_lock(&m->lock);
+    while (pos + 2 <= len) {
+        int flen = (p[pos] << 8) | p[pos + 1];
+
+        for (a = 0; a < c->filter_count; a++) {
+            if (((int)strlen(c->filters[a]) == flen) && (memcmp(c->filters[a], p + pos + 2, flen) == 0)) {
+                memmove(c->filters[a], c->filters[a + 1], (c->filter_count - a - 1) * sizeof(c->filters[0]));
+                c->filter_count--;
+                break;
+            }
+        }
+        pos += 2 + flen;
+    }
+    pthread_mutex_unlock(&m->lock);
+    mqttsim_ack(m, c, 0xb0, p);
+}
+
+// Returns -1 when the client should be dropped
+static int mqttsim_packet(struct mqttsim_t *m, struct mqttsim_client_t *c, unsigned char header, const unsigned char *p, int len)
+{
+    static const unsigned char connack[4] = { 0x20, 2, 0, 0 };
+    static const unsigned char pingresp[2] = { 0xd0, 0 };
+
+    switch (header >> 4) {
+    case 1:     // CONNECT
+        pthread_mutex_lock(&m->lock);
+        mqttsim_write(c, connack, sizeof(connack));
+        m->connections++;
+        pthread_mutex_unlock(&m->lock);
+        break;
+    case 3: {   // PUBLISH
+        int qos = (header >> 1) & 3;
+        int tlen;
+        int pos;
+
+        if (len < 2)
+            return -1;
+        tlen = (p[0] << 8) | p[1];
+        pos = 2 + tlen + (qos ? 2 : 0);
+        if (pos > len)
+            return -1;
+
+        m->publishes_rx++;
+        if (m->func_publish != NULL)
+            m->func_publish(m->pvt, (const char *)p + 2, tlen, (const char *)p + pos, len - pos, hubsim_now_us());
+
+        if (qos == 1)
+            mqttsim_ack(m, c, 0x40, p + 2 + tlen);
+        else if (qos == 2)
+            mqttsim_ack(m, c, 0x50, p + 2 + tlen);
+        break;
+    }
+    case 6:     // PUBREL
+        if (len >= 2)
+            mqttsim_ack(m, c, 0x70, p);
+        break;
+    case 8:     // SUBSCRIBE
+        if (len >= 2)
+            mqttsim_subscribe(m, c, p, len);
+        break;
+    case 10:    // UNSUBSCRIBE
+        if (len >= 2)
+            mqttsim_unsubscribe(m, c, p, len);
+        break;
+    case 12:    // PINGREQ
+        pthread_mutex_lock(&m->lock);
+        mqttsim_write(c, pingresp, sizeof(pingresp));
+        pthread_mutex_unlock(&m->lock);
+        break;
+    case 14:    // DISCONNECT
+        return -1;
+    default:    // PUBACK, PUBREC, PUBCOMP from the client need no answer
+        break;
+    }
+    return 0;
+}
+
+static int mqttsim_process(struct mqttsim_t *m, struct mqttsim_client_t *c)
+{
+    int pos = 0;
+
+    while (pos + 2 <= c->rx_len) {
+        int len = 0;
+        int shift = 0;
+        int n = 1;
+
+        do {
+            if (pos + n >= c->rx_len)
+                goto partial;
+            len |= (c->rx[pos + n] & 0x7f) << shift;
+            shift += 7;
+        } while ((c->rx[pos + n++] & 0x80) && (n < 5));
+
+        if (n + len > MQTTSIM_RX_BUFFER)
+            return -1;
+        if (pos + n + len > c->rx_len)
+            break;
+        if (mqttsim_packet(m, c, c->rx[pos], c->rx + pos + n, len) < 0)
+            return -1;
+        pos += n + len;
+    }
+partial:
+    memmove(c->rx, c->rx + pos, c->rx_len - pos);
+    c->rx_len -= pos;
+    return 0;
+}
+
+static void *mqttsim_thread(void *paramPtr)
+{
+    struct mqttsim_t *m = paramPtr;
+
+    while (1) {
+        struct pollfd fds[MQTTSIM_MAX_CLIENTS + 1];
+        int a;
+
+        fds[0].fd = m->listen_fd;
+        fds[0].events = POLLIN;
+        for (a = 0; a < MQTTSIM_MAX_CLIENTS; a++) {
+            fds[a + 1].fd = m->clients[a].fd;
+            fds[a + 1].events = POLLIN;
+            fds[a + 1].revents = 0;
+        }
+
+        if (poll(fds, MQTTSIM_MAX_CLIENTS + 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            return NULL;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(m->listen_fd, NULL, NULL);
+            int one = 1;
+
+            for (a = 0; (fd >= 0) && (a < MQTTSIM_MAX_CLIENTS); a++) {
+                if (m->clients[a].fd < 0) {
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    pthread_mutex_lock(&m->lock);
+                    m->clients[a].fd = fd;
+                    m->clients[a].rx_len = 0;
+                    m->clients[a].filter_count = 0;
+                    pthread_mutex_unlock(&m->lock);
+                    fd = -1;
+                }
+            }
+            if (fd >= 0)
+                close(fd);
+        }
+
+        for (a = 0; a < MQTTSIM_MAX_CLIENTS; a++) {
+            struct mqttsim_client_t *c = &m->clients[a];
+            ssize_t rc;
+
+            if ((c->fd < 0) || !(fds[a + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+
+            rc = recv(c->fd, c->rx + c->rx_len, MQTTSIM_RX_BUFFER - c->rx_len, 0);
+            if (rc <= 0) {
+                mqttsim_drop(m, c);
+                continue;
+            }
+            c->rx_len += rc;
+            if (mqttsim_process(m, c) < 0)
+                mqttsim_drop(m, c);
+        }
+    }
+    return NULL;
+}
+
+int mqttsim_start(struct mqttsim_t *m)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+    int a;
+
+    for (a = 0; a < MQTTSIM_MAX_CLIENTS; a++)
+        m->clients[a].rx = malloc(MQTTSIM_RX_BUFFER);
+
+    m->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (m->listen_fd < 0)
+        return -1;
+    setsockopt(m->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(m->port);
+    if ((bind(m->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) || (listen(m->listen_fd, 4) < 0)) {
+        perror("mqttsim bind");
+        close(m->listen_fd);
+        m->listen_fd = -1;
+        return -1;
+    }
+
+    return pthread_create(&m->thread, NULL, mqttsim_thread, m);
+}
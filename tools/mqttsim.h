@@ -0,0 +1,48 @@
+#ifndef MQTTSIM_H
+#define MQTTSIM_H
+
+#include <pthread.h>
+
+// Minimal MQTT 3.1.1 broker for local testing. Understands CONNECT, PUBLISH
+// (QoS 0-2 inbound), SUBSCRIBE, UNSUBSCRIBE and PINGREQ, and delivers to
+// subscribers at QoS 0. No retained messages, no sessions, no auth.
+
+#define MQTTSIM_PORT        1883
+#define MQTTSIM_MAX_CLIENTS 8
+#define MQTTSIM_MAX_FILTERS 32
+#define MQTTSIM_RX_BUFFER   262144
+
+struct mqttsim_client_t {
+    int fd;
+    char filters[MQTTSIM_MAX_FILTERS][128];
+    int filter_count;
+    unsigned char *rx;
+    int rx_len;
+};
+
+struct mqttsim_t {
+    // Configuration, set before mqttsim_start()
+    int port;
+
+    // Optional hook, called on the broker thread for every PUBLISH a client sends
+    void *pvt;
+    void (*func_publish)(void *pvt, const char *topic, int topic_len, const char *payload, int payload_len, unsigned long long now_us);
+
+    int listen_fd;
+    struct mqttsim_client_t clients[MQTTSIM_MAX_CLIENTS];
+    pthread_mutex_t lock;   // Guards client writes and subscriptions
+    pthread_t thread;
+
+    // Counters
+    unsigned long connections;
+    unsigned long publishes_rx;
+    unsigned long publishes_tx;
+};
+
+void mqttsim_init(struct mqttsim_t *m);
+int mqttsim_start(struct mqttsim_t *m);
+int mqttsim_publish(struct mqttsim_t *m, const char *topic, const char *payload, int payload_len);
+int mqttsim_subscribers(struct mqttsim_t *m, const char *topic);
+int mqttsim_topic_matches(const char *filter, const char *topic, int topic_len);
+
+#endif
@@ -0,0 +1,233 @@
+#include "hubsim.h"
+#include "mqttsim.h"
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Runs rako_adapter against two simulated hubs that answer the CHANNEL query
+// before the status one. With several hubs the topics are named after the
+// hub id in the status reply, so the configs can only go out once it is in.
+// Checks that nothing is published without a prefix and that a command sent
+// to each hub straight after discovery reaches it.
+
+#define ORDER_HUBS          2
+#define ORDER_READY_SECS    30
+#define ORDER_SEND_SECS     3
+#define ORDER_LEVEL         77
+
+struct ordertest_t {
+    struct hubsim_t hubs[ORDER_HUBS];
+    struct mqttsim_t broker;
+    pthread_mutex_t lock;
+    char prefix[ORDER_HUBS][64];
+    int configs[ORDER_HUBS];        // Config for room 1 channel 1 seen
+    int unnamed;                    // Configs published before the prefix was known
+    int routed[ORDER_HUBS];         // Command arrived at the hub
+};
+
+// Broker thread: every PUBLISH the adapter sends
+static void order_on_publish(void *pvt, const char *topic, int topic_len, const char *payload, int payload_len, unsigned long long now)
+{
+    struct ordertest_t *t = pvt;
+    char name[128];
+    int a;
+
+    if (topic_len >= (int)sizeof(name))
+        return;
+    memcpy(name, topic, topic_len);
+    name[topic_len] = 0;
+
+    pthread_mutex_lock(&t->lock);
+    if ((strncmp(name, "homeassistant/light/_", 21) == 0) && (payload_len > 0))
+        t->unnamed++;
+    for (a = 0; a < ORDER_HUBS; a++) {
+        char expect[128];
+
+        snprintf(expect, sizeof(expect), "homeassistant/light/%s_1_1/config", t->prefix[a]);
+        if (strcmp(name, expect) == 0)
+            t->configs[a] = 1;
+    }
+    pthread_mutex_unlock(&t->lock);
+}
+
+static struct ordertest_t *order_test;
+
+// Hub threads, pvt is the index of the hub
+static void order_on_send(void *pvt, int room, int channel, int level, int scene, unsigned long long now)
+{
+    int hub = (int)(long)pvt;
+
+    if ((room == 1) && (channel == 1) && (level == ORDER_LEVEL)) {
+        pthread_mutex_lock(&order_test->lock);
+        order_test->routed[hub] = 1;
+        pthread_mutex_unlock(&order_test->lock);
+    }
+}
+
+static pid_t start_adapter(const char *path, int hub_port, int broker_port, int verbose)
+{
+    char hub[ORDER_HUBS][64];
+    char broker[64];
+    pid_t pid;
+
+    snprintf(hub[0], sizeof(hub[0]), "127.0.0.1:%d", hub_port);
+    snprintf(hub[1], sizeof(hub[1]), "127.0.0.1:%d", hub_port + 1);
+    snprintf(broker, sizeof(broker), "tcp://127.0.0.1:%d", broker_port);
+
+    pid = fork();
+    if (pid == 0) {
+        if (verbose == 0) {
+            freopen("/dev/null", "w", stdout);
+            freopen("/dev/null", "w", stderr);
+        }
+        execl(path, path, "-r", hub[0], "-r", hub[1], "-m", broker, "-u", "test", "-p", "test",
+              "-w", "0", "-c", "0", (char *)NULL);
+        perror(path);
+        _exit(127);
+    }
+    return pid;
+}
+
+static int wait_ready(struct ordertest_t *t, pid_t adapter)
+{
+    int a, b;
+
+    for (a = 0; a < ORDER_READY_SECS * 10; a++) {
+        int ready = 1;
+
+        if ((adapter > 0) && (waitpid(adapter, NULL, WNOHANG) == adapter)) {
+            fprintf(stderr, "Adapter exited during startup\n");
+            return -1;
+        }
+
+        pthread_mutex_lock(&t->lock);
+        for (b = 0; b < ORDER_HUBS; b++)
+            ready &= t->configs[b];
+        pthread_mutex_unlock(&t->lock);
+
+        if (ready && (mqttsim_subscribers(&t->broker, "homeassistant/light/rako_1_1/set") > 0))
+            return 0;
+        usleep(100000);
+    }
+    fprintf(stderr, "Adapter did not publish both hubs within %d seconds\n", ORDER_READY_SECS);
+    return -1;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-a adapter] [-x] [-P hub port] [-B broker port] [-v]\n", name);
+    fprintf(stderr, "  -a  adapter binary to launch (default ../Debug/rako_adapter)\n");
+    fprintf(stderr, "  -x  do not launch the adapter, print its command line and wait for it\n");
+    fprintf(stderr, "  -P  first hub port, the second hub listens on the next one\n");
+}
+
+int main(int argc, char **argv)
+{
+    static struct ordertest_t test;
+    struct ordertest_t *t = &test;
+    const char *adapter_path = "../Debug/rako_adapter";
+    int external = 0, verbose = 0;
+    int hub_port = 19764, broker_port = 11884;
+    pid_t adapter = -1;
+    int failed = 0;
+    int opt, a, b;
+
+    while ((opt = getopt(argc, argv, "a:xP:B:vh")) != -1) {
+        switch (opt) {
+        case 'a': adapter_path = optarg; break;
+        case 'x': external = 1; break;
+        case 'P': hub_port = atoi(optarg); break;
+        case 'B': broker_port = atoi(optarg); break;
+        case 'v': verbose = 1; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    pthread_mutex_init(&t->lock, NULL);
+    order_test = t;
+
+    mqttsim_init(&t->broker);
+    t->broker.port = broker_port;
+    t->broker.pvt = t;
+    t->broker.func_publish = order_on_publish;
+    if (mqttsim_start(&t->broker) != 0)
+        return 1;
+
+    for (a = 0; a < ORDER_HUBS; a++) {
+        struct hubsim_t *h = &t->hubs[a];
+
+        hubsim_init(h);
+        h->port = hub_port + a;
+        h->rooms_n = 2;
+        h->channels_n = 2;
+        h->status_late = 1;
+        h->pvt = (void *)(long)a;
+        h->func_send = order_on_send;
+        snprintf(h->hub_id, sizeof(h->hub_id), "hub%c-000%d", 'A' + a, a + 1);
+        // As rako_set_prefix names them, rako_ and the hub id in lower case alphanumerics
+        snprintf(t->prefix[a], sizeof(t->prefix[a]), "rako_hub%c000%d", 'a' + a, a + 1);
+        if (hubsim_start(h) != 0)
+            return 1;
+    }
+
+    if (external) {
+        printf("Start the adapter with: rako_adapter -r 127.0.0.1:%d -r 127.0.0.1:%d -m tcp://127.0.0.1:%d -u test -p test -w 0 -c 0\n",
+               hub_port, hub_port + 1, broker_port);
+        fflush(stdout);
+    } else {
+        adapter = start_adapter(adapter_path, hub_port, broker_port, verbose);
+        if (adapter < 0)
+            return 1;
+    }
+
+    if (wait_ready(t, adapter) < 0) {
+        failed = 1;
+    } else {
+        char topic[128];
+        char payload[64];
+        int len;
+
+        len = snprintf(payload, sizeof(payload), "{\"state\":\"ON\",\"brightness\":%d}", ORDER_LEVEL);
+        for (a = 0; a < ORDER_HUBS; a++) {
+            snprintf(topic, sizeof(topic), "homeassistant/light/%s_1_1/set", t->prefix[a]);
+            mqttsim_publish(&t->broker, topic, payload, len);
+        }
+
+        for (b = 0; b < ORDER_SEND_SECS * 100; b++) {
+            int done;
+
+            pthread_mutex_lock(&t->lock);
+            done = t->routed[0] && t->routed[1];
+            pthread_mutex_unlock(&t->lock);
+            if (done)
+                break;
+            usleep(10000);
+        }
+
+        pthread_mutex_lock(&t->lock);
+        for (a = 0; a < ORDER_HUBS; a++) {
+            if (t->routed[a] == 0) {
+                printf("FAIL: command for %s never reached hub %d\n", t->prefix[a], a + 1);
+                failed = 1;
+            }
+        }
+        if (t->unnamed > 0) {
+            printf("FAIL: %d configs published before the hub id was known\n", t->unnamed);
+            failed = 1;
+        }
+        pthread_mutex_unlock(&t->lock);
+    }
+
+    if (adapter > 0) {
+        kill(adapter, SIGTERM);
+        waitpid(adapter, NULL, 0);
+    }
+    printf("%s\n", failed ? "FAIL" : "PASS");
+    return failed;
+}
@@ -0,0 +1,126 @@
+#include "topicmap.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+// FNV-1a, cheap and good enough for short topic strings
+unsigned int topicmap_hash(const char *data, int len)
+{
+    unsigned int h = 2166136261u;
+    int a;
+
+    for (a = 0; a < len; a++) {
+        h ^= (unsigned char)data[a];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+int topicmap_init(struct topicmap_t *m, unsigned int size)
+{
+    unsigned int s = 16;
+
+    while (s < size)
+        s <<= 1;
+
+    m->buckets = calloc(s, sizeof(struct topicmap_entry_t *));
+    if (m->buckets == NULL)
+        return -1;
+    m->size = s;
+    m->count = 0;
+    return 0;
+}
+
+struct topicmap_entry_t *topicmap_lookup(struct topicmap_t *m, const char *topic)
+{
+    unsigned int h = topicmap_hash(topic, strlen(topic));
+    struct topicmap_entry_t *e;
+
+    for (e = m->buckets[h & (m->size - 1)]; e != NULL; e = e->next) {
+        if ((e->hash == h) && (strcmp(e->topic, topic) == 0))
+            return e;
+    }
+    return NULL;
+}
+
+void *topicmap_get(struct topicmap_t *m, const char *topic)
+{
+    struct topicmap_entry_t *e = topicmap_lookup(m, topic);
+
+    if (e == NULL)
+        return NULL;
+    return e->value;
+}
+
+// Doubles the bucket array, entries are relinked rather than copied
+static void topicmap_grow(struct topicmap_t *m)
+{
+    unsigned int size = m->size * 2;
+    struct topicmap_entry_t **buckets = calloc(size, sizeof(struct topicmap_entry_t *));
+    unsigned int a;
+
+    if (buckets == NULL)
+        return;
+
+    for (a = 0; a < m->size; a++) {
+        struct topicmap_entry_t *e = m->buckets[a];
+
+        while (e != NULL) {
+            struct topicmap_entry_t *next = e->next;
+
+            e->next = buckets[e->hash & (size - 1)];
+            buckets[e->hash & (size - 1)] = e;
+            e = next;
+        }
+    }
+    free(m->buckets);
+    m->buckets = buckets;
+    m->size = size;
+}
+
+// Returns the existing entry when topic is already present
+struct topicmap_entry_t *topicmap_insert(struct topicmap_t *m, const char *topic, void *value)
+{
+    struct topicmap_entry_t *e = topicmap_lookup(m, topic);
+
+    if (e != NULL)
+        return e;
+
+    e = malloc(sizeof(struct topicmap_entry_t));
+    if (e == NULL)
+        return NULL;
+    e->topic = strdup(topic);
+    e->hash = topicmap_hash(topic, strlen(topic));
+    e->value = value;
+
+    if (m->count >= m->size)
+        topicmap_grow(m);
+
+    e->next = m->buckets[e->hash & (m->size - 1)];
+    m->buckets[e->hash & (m->size - 1)] = e;
+    m->count++;
+    return e;
+}
+
+// Unlinks and frees the entry, the value is returned to the caller to free
+void *topicmap_remove(struct topicmap_t *m, const char *topic)
+{
+    unsigned int h = topicmap_hash(topic, strlen(topic));
+    struct topicmap_entry_t **pe = &m->buckets[h & (m->size - 1)];
+
+    while (*pe != NULL) {
+        struct topicmap_entry_t *e = *pe;
+
+        if ((e->hash == h) && (strcmp(e->topic, topic) == 0)) {
+            void *value = e->value;
+
+            *pe = e->next;
+            free(e->topic);
+            free(e);
+            m->count--;
+            return value;
+        }
+        pe = &e->next;
+    }
+    return NULL;
+}
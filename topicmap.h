@@ -0,0 +1,31 @@
+#ifndef TOPICMAP_H
+#define TOPICMAP_H
+
+// Chained hash table keyed by MQTT topic. Entries are never moved once
+// created, so a value pointer stays valid until the entry is removed.
+struct topicmap_entry_t {
+    char *topic;
+    unsigned int hash;
+    void *value;
+    struct topicmap_entry_t *next;
+};
+
+struct topicmap_t {
+    struct topicmap_entry_t **buckets;
+    unsigned int size;      // Always a power of two
+    unsigned int count;
+};
+
+unsigned int topicmap_hash(const char *data, int len);
+
+int topicmap_init(struct topicmap_t *m, unsigned int size);
+void *topicmap_get(struct topicmap_t *m, const char *topic);
+struct topicmap_entry_t *topicmap_lookup(struct topicmap_t *m, const char *topic);
+struct topicmap_entry_t *topicmap_insert(struct topicmap_t *m, const char *topic, void *value);
+void *topicmap_remove(struct topicmap_t *m, const char *topic);
+
+#define TOPICMAP_FOREACH(m, bucket, entry) \
+    for ((bucket) = 0; (bucket) < (m)->size; (bucket)++) \
+        for ((entry) = (m)->buckets[(bucket)]; (entry) != NULL; (entry) = (entry)->next)
+
+#endif